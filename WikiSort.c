@@ -610,24 +610,10 @@ void MergeInPlace(char *array, size_t size, Range A, Range B, const Comparison c
     }
 }
 
-/* bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use */
-void new_WikiSort(char *array, const size_t len, const size_t size, const Comparison compare)
+/* bottom-up merge sort combined with an in-place merge algorithm, using cache_size items of memory at cache */
+/* (the cache can be NULL with a cache_size of 0, which is still fully functional) */
+void new_WikiSort(char *array, const size_t len, const size_t size, const Comparison compare, char *cache, size_t cache_size)
 {
-    // use a small cache to speed up some of the operations
-#if DYNAMIC_CACHE
-    size_t cache_size;
-    char *cache = NULL;
-#else
-    // since the cache size is fixed, it's still O(1) memory!
-    // just keep in mind that making it too small ruins the point (nothing will fit into it),
-    // and making it too large also ruins the point (so much for "low memory"!)
-    // removing the cache entirely still gives 70% of the performance of a standard merge
-#define CACHE_SIZE 0
-    const size_t cache_size = CACHE_SIZE;
-    //char cache[CACHE_SIZE*sizeof(Test)];
-    char *cache = NULL;
-#endif
-
     WikiIterator iterator;
 
     // if the array is of len 0, 1, 2, or 3, just sort them like so:
@@ -770,36 +756,12 @@ void new_WikiSort(char *array, const size_t len, const size_t size, const Compar
         return;
     }
 
-#if DYNAMIC_CACHE
-    // good choices for the cache len are:
-    // (len + 1)/2 – turns into a full-speed standard merge sort since everything fits into the cache
-    cache_size = (len + 1) / 2;
-    cache = malloc(cache_size * size);
-
-    if (!cache)
+    // no merge ever needs more than half of the array in the cache
+    if (cache == NULL)
     {
-        // sqrt((len + 1)/2) + 1 – this will be the len of the A blocks at the largest level of merges,
-        // so a buffer of this len would allow it to skip using internal or in-place merges for anything
-        cache_size = sqrt(cache_size) + 1;
-        cache = malloc(cache_size * size);
-
-        if (!cache)
-        {
-            // 512 – chosen from careful testing as a good balance between fixed-len memory use and run time
-            if (cache_size > 512)
-            {
-                cache_size = 512;
-                cache = malloc(cache_size * size);
-            }
-
-            // 0 – if the system simply cannot allocate any extra memory whatsoever, no memory works just fine
-            if (!cache)
-            {
-                cache_size = 0;
-            }
-        }
+        cache_size = 0;
     }
-#endif
+    cache_size = Min(cache_size, (len + 1) / 2);
 
     // then merge sort the higher levels, which can be 8-15, 16-31, 32-63, 64-127, etc.
     while (true)
@@ -1427,29 +1389,63 @@ void new_WikiSort(char *array, const size_t len, const size_t size, const Compar
         }
     }
 
-#if DYNAMIC_CACHE
-    if (cache)
-    {
-        free(cache);
-    }
-#endif
-
-#undef CACHE_SIZE
-}
-/* bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use */
-void WikiSort(void *array, const size_t len, const size_t size, const Comparison compare)
-{
-    new_WikiSort((char *)array, len, sizeof(Test), compare);
 }
 
+/* sort using a caller-supplied buffer of buffer_len items as the cache */
+/* any buffer_len works, from 0 up to (len + 1)/2, where it turns into a full-speed standard merge sort */
 void WikiSort_with_buffer(void *array, const size_t len, const size_t size, const Comparison compare, void *buffer, const size_t buffer_len)
 {
-    new_WikiSort((char *)array, len, sizeof(Test), compare);
+    new_WikiSort((char *)array, len, size, compare, (char *)buffer, buffer_len);
 }
 
+/* sort using as large a cache as can be allocated, falling back to smaller sizes and eventually to no cache at all */
 void WikiSort_with_dynamic_buffer(void *array, const size_t len, const size_t size, const Comparison compare)
 {
-    new_WikiSort((char *)array, len, sizeof(Test), compare);
+    // good choices for the cache len are:
+    // (len + 1)/2 – turns into a full-speed standard merge sort since everything fits into the cache
+    size_t cache_size = (len + 1) / 2;
+    char *cache = malloc(cache_size * size);
+
+    if (!cache)
+    {
+        // sqrt((len + 1)/2) + 1 – this will be the len of the A blocks at the largest level of merges,
+        // so a buffer of this len would allow it to skip using internal or in-place merges for anything
+        cache_size = sqrt(cache_size) + 1;
+        cache = malloc(cache_size * size);
+
+        if (!cache)
+        {
+            // 512 – chosen from careful testing as a good balance between fixed-len memory use and run time
+            if (cache_size > 512)
+            {
+                cache_size = 512;
+                cache = malloc(cache_size * size);
+            }
+
+            // 0 – if the system simply cannot allocate any extra memory whatsoever, no memory works just fine
+            if (!cache)
+            {
+                cache_size = 0;
+            }
+        }
+    }
+
+    new_WikiSort((char *)array, len, size, compare, cache, cache_size);
+
+    if (cache)
+    {
+        free(cache);
+    }
+}
+
+/* bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use */
+void WikiSort(void *array, const size_t len, const size_t size, const Comparison compare)
+{
+#if DYNAMIC_CACHE
+    WikiSort_with_dynamic_buffer(array, len, size, compare);
+#else
+    new_WikiSort((char *)array, len, size, compare, NULL, 0);
+#endif
 }
 
 
@@ -1603,6 +1599,10 @@ int main()
     size_t compares1, compares2, total_compares1 = 0, total_compares2 = 0;
 #endif
 #if !SLOW_COMPARISONS && VERIFY
+    const size_t buffer_len = 512;
+    Var(buffer, Allocate(Test, buffer_len));
+    Var(array3, Allocate(Test, max_size));
+    Var(array4, Allocate(Test, max_size));
     size_t test_case;
     __typeof__(&TestingRandom) test_cases[] =
     {
@@ -1642,6 +1642,9 @@ int main()
             array1[index] = array2[index] = item;
         }
 
+        memcpy(array3, array1, total * sizeof(Test));
+        memcpy(array4, array1, total * sizeof(Test));
+
         WikiSort(array1, total, sizeof(Test), compare);
 
         MergeSort(array2, total, sizeof(Test), compare);
@@ -1651,8 +1654,27 @@ int main()
         {
 			assert(compare(&array1[index], &array2[index]) >= 0 && compare(&array2[index], &array1[index]) >= 0);
         }
+
+        /* also test the versions that use a cache */
+        WikiSort_with_buffer(array3, total, sizeof(Test), compare, buffer, buffer_len);
+        WikiVerify(array3, Range_new(0, total), compare, "buffer test case failed");
+        for (index = 0; index < total; index++)
+        {
+            assert(compare(&array3[index], &array2[index]) >= 0 && compare(&array2[index], &array3[index]) >= 0);
+        }
+
+        WikiSort_with_dynamic_buffer(array4, total, sizeof(Test), compare);
+        WikiVerify(array4, Range_new(0, total), compare, "dynamic buffer test case failed");
+        for (index = 0; index < total; index++)
+        {
+            assert(compare(&array4[index], &array2[index]) >= 0 && compare(&array2[index], &array4[index]) >= 0);
+        }
     }
     printf("passed!\n");
+
+    free(buffer);
+    free(array3);
+    free(array4);
 #endif
 
     total_time = Seconds();
@@ -3,20 +3,38 @@
  https://github.com/BonzaiThePenguin/WikiSort
 
  to run:
- clang++ -o WikiSort.x WikiSort.cpp -O3
+ clang++ -o WikiSort.x WikiSort.cpp -O3 -pthread
  (or replace 'clang++' with 'g++')
+ (add -mavx2 or -mavx512f to use SIMD sorting networks for int32_t, int64_t, float, and double)
  ./WikiSort.x
 ***********************************************************/
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
+#include <condition_variable>
+#include <cstdint>
 #include <ctime>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+    #include <immintrin.h>
+#endif
+
 // record the number of comparisons and assignments
 // note that this reduces WikiSort's performance when enabled
 #define PROFILE false
@@ -32,8 +50,11 @@
 // if true, test against std::__inplace_stable_sort() rather than std::stable_sort()
 #define TEST_INPLACE false
 
-// whether to give WikiSort a full-size cache, to see how it performs when given more memory
-#define DYNAMIC_CACHE false
+// the stack memory for WikiSort's fixed-size cache, in bytes, which is about the size of the L1 data cache
+// (the number of items this holds depends on their size, and each call can choose its own size with Wiki::StackCache)
+#ifndef WIKISORT_CACHE_BYTES
+    #define WIKISORT_CACHE_BYTES 32768
+#endif
 
 
 double Seconds() { return std::clock() * 1.0/CLOCKS_PER_SEC; }
@@ -73,6 +94,199 @@ Unsigned Hyperfloor(Unsigned value) {
     return value - (value >> 1);
 }
 
+// whether the iterator is known to point into a contiguous array, so the SIMD code can work on the raw pointers
+template <typename RandomAccessIterator>
+struct Contiguous {
+    typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+    static const bool value = std::is_same<RandomAccessIterator, T *>::value ||
+                              std::is_same<RandomAccessIterator, const T *>::value ||
+                              std::is_same<RandomAccessIterator, typename std::vector<T>::iterator>::value ||
+                              std::is_same<RandomAccessIterator, typename std::vector<T>::const_iterator>::value;
+};
+
+// whether merges and searches should select each item without branching on the comparison, which avoids
+// mispredicting about half of the comparisons on random data. the comparison is made either way, so this only
+// depends on the items being cheap to copy, and larger items are better off with the branch
+template <typename T>
+struct Branchless {
+    static const bool enabled = std::is_trivially_copyable<T>::value && sizeof(T) <= 2 * sizeof(void *);
+};
+
+// hint that an item will be read soon, for searches where the next address depends on the current comparison
+template <typename RandomAccessIterator>
+void Prefetch(RandomAccessIterator index) {
+#if defined(__GNUC__)
+    __builtin_prefetch(&*index);
+#endif
+}
+
+// whether an item belongs before the value, for a lower bound (item < value) or an upper bound (item <= value)
+template <bool upper, typename T1, typename T2, typename Comparison>
+bool Before(const T1 & item, const T2 & value, Comparison compare) {
+    return upper ? !compare(value, item) : compare(item, value);
+}
+
+// binary search that selects the next half without branching, since the comparisons are as unpredictable as it gets
+// both possible next probes are prefetched, so the memory access for the next step is already underway
+template <bool upper, typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator BranchlessSearch(RandomAccessIterator first, RandomAccessIterator last,
+                                      const T & value, Comparison compare) {
+    std::size_t length = std::distance(first, last);
+    if (length == 0) return first;
+
+    while (length > 1) {
+        std::size_t half = length / 2;
+        Prefetch(first + half / 2);
+        Prefetch(first + half + half / 2);
+        first += Before<upper>(first[half], value, compare) ? half : 0;
+        length -= half;
+    }
+    return first + Before<upper>(*first, value, compare);
+}
+
+// finishing a search with SIMD registers: compare the value against a full register of items at once,
+// then count how many of them belong before it.
+// this is only used for arithmetic types compared with std::less, where the comparison can be done in the register
+template <typename T>
+struct VectorSearchLanes {
+    static const bool enabled = false;
+};
+
+#if defined(__AVX2__)
+template <>
+struct VectorSearchLanes<int32_t> {
+    static const bool enabled = true;
+    static const std::ptrdiff_t lanes = 8;
+    typedef __m256i Vector;
+
+    static Vector set(int32_t value) { return _mm256_set1_epi32(value); }
+    static Vector load(const int32_t *from) { return _mm256_loadu_si256((const __m256i *)from); }
+
+    // a bit for each lane that belongs before the value
+    template <bool upper>
+    static int before(Vector items, Vector value) {
+        __m256i mask = upper ? _mm256_xor_si256(_mm256_cmpgt_epi32(items, value), _mm256_set1_epi32(-1))
+                             : _mm256_cmpgt_epi32(value, items);
+        return _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+    }
+};
+
+template <>
+struct VectorSearchLanes<int64_t> {
+    static const bool enabled = true;
+    static const std::ptrdiff_t lanes = 4;
+    typedef __m256i Vector;
+
+    static Vector set(int64_t value) { return _mm256_set1_epi64x(value); }
+    static Vector load(const int64_t *from) { return _mm256_loadu_si256((const __m256i *)from); }
+
+    template <bool upper>
+    static int before(Vector items, Vector value) {
+        __m256i mask = upper ? _mm256_xor_si256(_mm256_cmpgt_epi64(items, value), _mm256_set1_epi64x(-1))
+                             : _mm256_cmpgt_epi64(value, items);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(mask));
+    }
+};
+
+template <>
+struct VectorSearchLanes<float> {
+    static const bool enabled = true;
+    static const std::ptrdiff_t lanes = 8;
+    typedef __m256 Vector;
+
+    static Vector set(float value) { return _mm256_set1_ps(value); }
+    static Vector load(const float *from) { return _mm256_loadu_ps(from); }
+
+    template <bool upper>
+    static int before(Vector items, Vector value) {
+        return _mm256_movemask_ps(upper ? _mm256_cmp_ps(items, value, _CMP_LE_OQ) : _mm256_cmp_ps(items, value, _CMP_LT_OQ));
+    }
+};
+
+template <>
+struct VectorSearchLanes<double> {
+    static const bool enabled = true;
+    static const std::ptrdiff_t lanes = 4;
+    typedef __m256d Vector;
+
+    static Vector set(double value) { return _mm256_set1_pd(value); }
+    static Vector load(const double *from) { return _mm256_loadu_pd(from); }
+
+    template <bool upper>
+    static int before(Vector items, Vector value) {
+        return _mm256_movemask_pd(upper ? _mm256_cmp_pd(items, value, _CMP_LE_OQ) : _mm256_cmp_pd(items, value, _CMP_LT_OQ));
+    }
+};
+#endif
+
+template <typename RandomAccessIterator, typename T, typename Comparison>
+struct VectorSearch {
+    typedef typename std::iterator_traits<RandomAccessIterator>::value_type Item;
+    static const bool enabled = VectorSearchLanes<Item>::enabled && Contiguous<RandomAccessIterator>::value &&
+        std::is_same<T, Item>::value && std::is_same<Comparison, std::less<Item> >::value;
+};
+
+template <bool upper, typename T>
+const T * VectorSearchArray(const T *first, const T *last, const T & value) {
+    typedef VectorSearchLanes<T> Lanes;
+    const std::ptrdiff_t lanes = Lanes::lanes;
+    std::ptrdiff_t length = last - first;
+
+    // probing a full register of evenly spaced items at a time needs gathers, which are too slow to beat a plain
+    // branchless binary search, so only switch to the registers once the range is down to a few of them
+    while (length > 4 * lanes) {
+        std::ptrdiff_t half = length / 2;
+        Prefetch(first + half / 2);
+        Prefetch(first + half + half / 2);
+        first += Before<upper>(first[half], value, std::less<T>()) ? half : 0;
+        length -= half;
+    }
+
+    // the range is sorted, so the number of items that belong before the value is where the value goes
+    const typename Lanes::Vector target = Lanes::set(value);
+    std::ptrdiff_t count = 0;
+    const T *index = first;
+    for (last = first + length ; last - index >= lanes ; index += lanes) {
+        count += __builtin_popcount(Lanes::template before<upper>(Lanes::load(index), target));
+    }
+    for (; index != last ; ++index) {
+        count += Before<upper>(*index, value, std::less<T>());
+    }
+    return first + count;
+}
+
+template <bool upper, typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator Search(RandomAccessIterator first, RandomAccessIterator last,
+                            const T & value, Comparison, std::true_type) {
+    if (first == last) return first;
+    const T *array = &*first;
+    return first + (VectorSearchArray<upper>(array, array + (last - first), value) - array);
+}
+
+template <bool upper, typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator Search(RandomAccessIterator first, RandomAccessIterator last,
+                            const T & value, Comparison compare, std::false_type) {
+    typedef typename std::iterator_traits<RandomAccessIterator>::value_type Item;
+
+    // larger items tend to have more expensive comparisons, which makes the mispredicted branches matter less
+    if (Branchless<Item>::enabled) return BranchlessSearch<upper>(first, last, value, compare);
+    if (upper) return std::upper_bound(first, last, value, compare);
+    return std::lower_bound(first, last, value, compare);
+}
+
+// std::lower_bound and std::upper_bound, using the faster searches above when possible
+template <typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator LowerBound(RandomAccessIterator first, RandomAccessIterator last, const T & value, Comparison compare) {
+    return Search<false>(first, last, value, compare, std::integral_constant<bool,
+                         VectorSearch<RandomAccessIterator, T, Comparison>::enabled>());
+}
+
+template <typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator UpperBound(RandomAccessIterator first, RandomAccessIterator last, const T & value, Comparison compare) {
+    return Search<true>(first, last, value, compare, std::integral_constant<bool,
+                        VectorSearch<RandomAccessIterator, T, Comparison>::enabled>());
+}
+
 // combine a linear search with a binary search to reduce the number of comparisons in situations
 // where have some idea as to how many unique values there are and where the next value might be
 template <typename RandomAccessIterator, typename T, typename Comparison>
@@ -86,10 +300,10 @@ RandomAccessIterator FindFirstForward(RandomAccessIterator first, RandomAccessIt
     RandomAccessIterator index;
     for (index = first + skip ; compare(*(index - 1), value) ; index += skip) {
         if (index >= last - skip) {
-            return std::lower_bound(index, last, value, compare);
+            return LowerBound(index, last, value, compare);
         }
     }
-    return std::lower_bound(index - skip, index, value, compare);
+    return LowerBound(index - skip, index, value, compare);
 }
 
 template <typename RandomAccessIterator, typename T, typename Comparison>
@@ -103,10 +317,10 @@ RandomAccessIterator FindLastForward(RandomAccessIterator first, RandomAccessIte
     RandomAccessIterator index;
     for (index = first + skip ; !compare(value, *(index - 1)) ; index += skip) {
         if (index >= last - skip) {
-            return std::upper_bound(index, last, value, compare);
+            return UpperBound(index, last, value, compare);
         }
     }
-    return std::upper_bound(index - skip, index, value, compare);
+    return UpperBound(index - skip, index, value, compare);
 }
 
 template <typename RandomAccessIterator, typename T, typename Comparison>
@@ -120,10 +334,10 @@ RandomAccessIterator FindFirstBackward(RandomAccessIterator first, RandomAccessI
     RandomAccessIterator index;
     for (index = last - skip ; index > first && !compare(*(index - 1), value) ; index -= skip) {
         if (index < first + skip) {
-            return std::lower_bound(first, index, value, compare);
+            return LowerBound(first, index, value, compare);
         }
     }
-    return std::lower_bound(index, index + skip, value, compare);
+    return LowerBound(index, index + skip, value, compare);
 }
 
 template <typename RandomAccessIterator, typename T, typename Comparison>
@@ -137,10 +351,46 @@ RandomAccessIterator FindLastBackward(RandomAccessIterator first, RandomAccessIt
     RandomAccessIterator index;
     for (index = last - skip ; index > first && compare(value, *(index - 1)) ; index -= skip) {
         if (index < first + skip) {
-            return std::upper_bound(first, index, value, compare);
+            return UpperBound(first, index, value, compare);
         }
     }
-    return std::upper_bound(index, index + skip, value, compare);
+    return UpperBound(index, index + skip, value, compare);
+}
+
+// exponential search, which checks 1, 2, 4, 8... items ahead before switching to a binary search
+// this takes O(log distance) comparisons, so it's much faster when the value is likely to be close to first
+template <typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator FindFirstGallop(RandomAccessIterator first, RandomAccessIterator last,
+                                     const T & value, Comparison compare) {
+    std::ptrdiff_t skip = 1;
+    while (skip < last - first && compare(first[skip - 1], value)) {
+        first += skip;
+        skip *= 2;
+    }
+    return LowerBound(first, first + std::min(skip, (std::ptrdiff_t)(last - first)), value, compare);
+}
+
+template <typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator FindLastGallop(RandomAccessIterator first, RandomAccessIterator last,
+                                    const T & value, Comparison compare) {
+    std::ptrdiff_t skip = 1;
+    while (skip < last - first && !compare(value, first[skip - 1])) {
+        first += skip;
+        skip *= 2;
+    }
+    return UpperBound(first, first + std::min(skip, (std::ptrdiff_t)(last - first)), value, compare);
+}
+
+// the same exponential search for an upper bound, but starting from last and working backward
+template <typename RandomAccessIterator, typename T, typename Comparison>
+RandomAccessIterator FindLastGallopBackward(RandomAccessIterator first, RandomAccessIterator last,
+                                            const T & value, Comparison compare) {
+    std::ptrdiff_t skip = 1;
+    while (skip < last - first && compare(value, *(last - skip))) {
+        last -= skip;
+        skip *= 2;
+    }
+    return UpperBound(last - std::min(skip, (std::ptrdiff_t)(last - first)), last, value, compare);
 }
 
 template <typename BidirectionalIterator, typename Comparison>
@@ -155,21 +405,280 @@ void InsertionSort(BidirectionalIterator first, BidirectionalIterator last, Comp
         // Compare first so we can avoid 2 moves for
         // an element already positioned correctly.
         if (compare(*sift, *sift_1)) {
-            T tmp = *sift;
+            T tmp = std::move(*sift);
             do {
-                *sift-- = *sift_1;
+                *sift-- = std::move(*sift_1);
             } while (sift != first && compare(tmp, *--sift_1));
-            *sift = tmp;
+            *sift = std::move(tmp);
         }
     }
 }
 
 namespace Wiki {
+    // after this many items in a row come from the same side of a merge, gallop ahead to find the rest of them
+    const std::size_t merge_gallop = 7;
+
+    // merge A and B into insert_index until either A or B runs out
+    // (ties go to A, which is what keeps the merge stable)
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename RandomAccessIterator3, typename Comparison>
+    void MergeUntilEmpty(RandomAccessIterator1 & A_index, RandomAccessIterator1 A_last,
+                         RandomAccessIterator2 & B_index, RandomAccessIterator2 B_last,
+                         RandomAccessIterator3 & insert_index, Comparison compare, std::false_type) {
+        if (A_index == A_last || B_index == B_last) return;
+
+        std::size_t A_count = 0, B_count = 0;
+        while (true) {
+            if (!compare(*B_index, *A_index)) {
+                *insert_index = std::move(*A_index);
+                ++A_index;
+                ++insert_index;
+                if (A_index == A_last) break;
+
+                B_count = 0;
+                if (++A_count == merge_gallop) {
+                    RandomAccessIterator1 A_next = FindLastGallop(A_index, A_last, *B_index, compare);
+                    insert_index = std::move(A_index, A_next, insert_index);
+                    A_index = A_next;
+                    A_count = 0;
+                    if (A_index == A_last) break;
+                }
+            } else {
+                *insert_index = std::move(*B_index);
+                ++B_index;
+                ++insert_index;
+                if (B_index == B_last) break;
+
+                A_count = 0;
+                if (++B_count == merge_gallop) {
+                    RandomAccessIterator2 B_next = FindFirstGallop(B_index, B_last, *A_index, compare);
+                    insert_index = std::move(B_index, B_next, insert_index);
+                    B_index = B_next;
+                    B_count = 0;
+                    if (B_index == B_last) break;
+                }
+            }
+        }
+    }
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename RandomAccessIterator3, typename Comparison>
+    void MergeUntilEmpty(RandomAccessIterator1 & A_index, RandomAccessIterator1 A_last,
+                         RandomAccessIterator2 & B_index, RandomAccessIterator2 B_last,
+                         RandomAccessIterator3 & insert_index, Comparison compare, std::true_type) {
+        // work in groups of 'run' items, so neither side can run out partway through a group
+        // before each group, check whether the next 'run' items all come from the same side, since a
+        // branchless merge can't take advantage of that, but the branch on that check is well predicted
+        // (and if they do, gallop ahead to find how many more come from that side)
+        const std::ptrdiff_t run = 8;
+        while (A_last - A_index >= run && B_last - B_index >= run) {
+            if (!compare(*B_index, A_index[run - 1])) {
+                RandomAccessIterator1 A_next = FindLastGallop(A_index + run, A_last, *B_index, compare);
+                insert_index = std::move(A_index, A_next, insert_index);
+                A_index = A_next;
+            } else if (compare(B_index[run - 1], *A_index)) {
+                RandomAccessIterator2 B_next = FindFirstGallop(B_index + run, B_last, *A_index, compare);
+                insert_index = std::move(B_index, B_next, insert_index);
+                B_index = B_next;
+            } else {
+                for (std::ptrdiff_t count = 0; count < run; ++count) {
+                    // select the address of the next item rather than branching, so the compiler can use a conditional move
+                    bool from_B = compare(*B_index, *A_index);
+                    *insert_index = std::move(*(from_B ? &*B_index : &*A_index));
+                    B_index += from_B;
+                    A_index += !from_B;
+                    ++insert_index;
+                }
+            }
+        }
+
+        // one side has fewer than 'run' items left, which is also the case for the whole merge when
+        // one side is much shorter than the other. if the other side is much longer, insert each of the few
+        // remaining items by galloping through it, rather than comparing against every item on the way
+        const std::ptrdiff_t A_left = A_last - A_index, B_left = B_last - B_index;
+        if (A_left > 0 && B_left >= A_left * run) {
+            for (; A_index != A_last; ++A_index, ++insert_index) {
+                RandomAccessIterator2 B_next = FindFirstGallop(B_index, B_last, *A_index, compare);
+                insert_index = std::move(B_index, B_next, insert_index);
+                B_index = B_next;
+                *insert_index = std::move(*A_index);
+            }
+            return;
+        }
+        if (B_left > 0 && A_left >= B_left * run) {
+            for (; B_index != B_last; ++B_index, ++insert_index) {
+                RandomAccessIterator1 A_next = FindLastGallop(A_index, A_last, *B_index, compare);
+                insert_index = std::move(A_index, A_next, insert_index);
+                A_index = A_next;
+                *insert_index = std::move(*B_index);
+            }
+            return;
+        }
+
+        while (A_index != A_last && B_index != B_last) {
+            bool from_B = compare(*B_index, *A_index);
+            *insert_index = std::move(*(from_B ? &*B_index : &*A_index));
+            B_index += from_B;
+            A_index += !from_B;
+            ++insert_index;
+        }
+    }
+
+    // merging with SIMD registers, using a bitonic merge network on one register from A and one from B at a time.
+    // this is only used for integers compared with std::less, where equal keys are indistinguishable,
+    // since a bitonic merge does not keep the original order of equal items
+    template <typename T>
+    struct VectorMergeLanes {
+        static const bool enabled = false;
+    };
+
+#if defined(__AVX2__)
+    template <>
+    struct VectorMergeLanes<int32_t> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 8;
+        typedef __m256i Vector;
+
+        static Vector load(const int32_t *from) { return _mm256_loadu_si256((const __m256i *)from); }
+        static void store(int32_t *to, Vector value) { _mm256_storeu_si256((__m256i *)to, value); }
+
+        // sort a bitonic sequence by comparing items 4, 2, then 1 lanes apart
+        static Vector bitonic(Vector value) {
+            Vector other = _mm256_permute2x128_si256(value, value, 1);
+            value = _mm256_blend_epi32(_mm256_min_epi32(value, other), _mm256_max_epi32(value, other), 0xF0);
+            other = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+            value = _mm256_blend_epi32(_mm256_min_epi32(value, other), _mm256_max_epi32(value, other), 0xCC);
+            other = _mm256_shuffle_epi32(value, _MM_SHUFFLE(2, 3, 0, 1));
+            value = _mm256_blend_epi32(_mm256_min_epi32(value, other), _mm256_max_epi32(value, other), 0xAA);
+            return value;
+        }
+
+        // merge two sorted registers, leaving the smaller half in 'a' and the larger half in 'b'
+        static void merge(Vector & a, Vector & b) {
+            b = _mm256_permutevar8x32_epi32(b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+            Vector min = _mm256_min_epi32(a, b);
+            b = bitonic(_mm256_max_epi32(a, b));
+            a = bitonic(min);
+        }
+    };
+
+    template <>
+    struct VectorMergeLanes<int64_t> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 4;
+        typedef __m256i Vector;
+
+        static Vector load(const int64_t *from) { return _mm256_loadu_si256((const __m256i *)from); }
+        static void store(int64_t *to, Vector value) { _mm256_storeu_si256((__m256i *)to, value); }
+
+        // AVX2 has no 64-bit min or max, so compare and blend instead
+        static Vector min(Vector a, Vector b) { return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b)); }
+        static Vector max(Vector a, Vector b) { return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b)); }
+
+        // sort a bitonic sequence by comparing items 2, then 1 lanes apart
+        static Vector bitonic(Vector value) {
+            Vector other = _mm256_permute4x64_epi64(value, _MM_SHUFFLE(1, 0, 3, 2));
+            value = _mm256_blend_epi32(min(value, other), max(value, other), 0xF0);
+            other = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+            value = _mm256_blend_epi32(min(value, other), max(value, other), 0xCC);
+            return value;
+        }
+
+        static void merge(Vector & a, Vector & b) {
+            b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 1, 2, 3));
+            Vector lower = min(a, b);
+            b = bitonic(max(a, b));
+            a = bitonic(lower);
+        }
+    };
+#endif
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename RandomAccessIterator3, typename Comparison>
+    struct VectorMerge {
+        typedef typename std::iterator_traits<RandomAccessIterator1>::value_type T;
+        static const bool enabled = VectorMergeLanes<T>::enabled &&
+            Contiguous<RandomAccessIterator1>::value && Contiguous<RandomAccessIterator2>::value &&
+            Contiguous<RandomAccessIterator3>::value && std::is_same<Comparison, std::less<T> >::value;
+    };
+
+    // merge all of A and B into insert_index with SIMD registers. insert_index may be where B already is,
+    // as long as it's at least the length of A before it, in which case the end of B is left where it is
+    template <typename T>
+    void VectorMergeInto(const T *A_index, const T *A_last, const T *B_index, const T *B_last, T *insert_index) {
+        typedef VectorMergeLanes<T> Lanes;
+        const std::ptrdiff_t lanes = Lanes::lanes;
+        T pending[lanes], merged[lanes * 2];
+
+        if (A_last - A_index >= lanes && B_last - B_index >= lanes) {
+            typename Lanes::Vector lower = Lanes::load(A_index), upper = Lanes::load(B_index);
+            A_index += lanes;
+            B_index += lanes;
+
+            while (true) {
+                Lanes::merge(lower, upper);
+                Lanes::store(insert_index, lower);
+                insert_index += lanes;
+                if (A_last - A_index < lanes || B_last - B_index < lanes) break;
+
+                // the next items to merge in come from whichever side has the smaller next item
+                if (*B_index < *A_index) {
+                    lower = Lanes::load(B_index);
+                    B_index += lanes;
+                } else {
+                    lower = Lanes::load(A_index);
+                    A_index += lanes;
+                }
+            }
+
+            // 'upper' still holds items that come after everything written so far,
+            // so merge them with what's left of whichever side ran low, then finish up with the other side
+            Lanes::store(pending, upper);
+            if (A_last - A_index < lanes) {
+                A_last = std::merge(pending, pending + lanes, A_index, A_last, merged);
+                A_index = merged;
+            } else {
+                B_last = std::merge(pending, pending + lanes, B_index, B_last, merged);
+                B_index = merged;
+            }
+        }
+
+        MergeUntilEmpty(A_index, A_last, B_index, B_last, insert_index, std::less<T>(), std::true_type());
+        insert_index = std::move(A_index, A_last, insert_index);
+        if (insert_index != B_index) std::move(B_index, B_last, insert_index);
+    }
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename RandomAccessIterator3, typename Comparison>
+    void MergeInto(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                   RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+                   RandomAccessIterator3 insert_index, Comparison, std::true_type) {
+        VectorMergeInto(&*first1, &*first1 + (last1 - first1), &*first2, &*first2 + (last2 - first2), &*insert_index);
+    }
+
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename RandomAccessIterator3, typename Comparison>
+    void MergeInto(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                   RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+                   RandomAccessIterator3 insert_index, Comparison compare, std::false_type) {
+        typedef typename std::iterator_traits<RandomAccessIterator1>::value_type T;
+        MergeUntilEmpty(first1, last1, first2, last2, insert_index, compare,
+                        std::integral_constant<bool, Branchless<T>::enabled>());
+        insert_index = std::move(first1, last1, insert_index);
+        std::move(first2, last2, insert_index);
+    }
+
+    // merge two non-empty ranges into a separate range, like std::merge but using the faster merges above when possible
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename RandomAccessIterator3, typename Comparison>
+    void MergeInto(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                   RandomAccessIterator2 first2, RandomAccessIterator2 last2,
+                   RandomAccessIterator3 insert_index, Comparison compare) {
+        MergeInto(first1, last1, first2, last2, insert_index, compare, std::integral_constant<bool,
+                  VectorMerge<RandomAccessIterator1, RandomAccessIterator2, RandomAccessIterator3, Comparison>::enabled>());
+    }
+
     // merge operation using an external buffer
     template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison>
     void MergeExternal(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
                        RandomAccessIterator1 first2, RandomAccessIterator1 last2,
                        RandomAccessIterator2 cache, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator1>::value_type T;
+
         // A fits into the cache, so use that instead of the internal buffer
         RandomAccessIterator2 A_index = cache;
         RandomAccessIterator2 A_last = cache + std::distance(first1, last1);
@@ -178,23 +687,54 @@ namespace Wiki {
         RandomAccessIterator1 insert_index = first1;
 
         if (last2 - first2 > 0 && last1 - first1 > 0) {
+            if (VectorMerge<RandomAccessIterator2, RandomAccessIterator1, RandomAccessIterator1, Comparison>::enabled) {
+                // the SIMD merge handles everything, including the remainder of A
+                MergeInto(A_index, A_last, B_index, B_last, insert_index, compare);
+                return;
+            }
+            MergeUntilEmpty(A_index, A_last, B_index, B_last, insert_index, compare,
+                            std::integral_constant<bool, Branchless<T>::enabled>());
+        }
+
+        // copy the remainder of A into the final array
+        std::move(A_index, A_last, insert_index);
+    }
+
+    // merge operation using an external buffer that holds B instead of A, for when only B fits into it
+    // this works backward from the end, and gallops through A since it's usually the longer of the two
+    template <typename RandomAccessIterator1, typename RandomAccessIterator2, typename Comparison>
+    void MergeExternalBackward(RandomAccessIterator1 first1, RandomAccessIterator1 last1,
+                               RandomAccessIterator1 first2, RandomAccessIterator1 last2,
+                               RandomAccessIterator2 cache, Comparison compare) {
+        RandomAccessIterator1 A_index = last1;
+        RandomAccessIterator2 B_index = cache + std::distance(first2, last2);
+        RandomAccessIterator1 insert_index = last2;
+
+        if (last2 - first2 > 0 && last1 - first1 > 0) {
+            std::size_t A_count = 0;
             while (true) {
-                if (!compare(*B_index, *A_index)) {
-                    *insert_index = *A_index;
-                    ++A_index;
-                    ++insert_index;
-                    if (A_index == A_last) break;
+                // ties go to B here, since it's placing the later items first
+                if (compare(*(B_index - 1), *(A_index - 1))) {
+                    *--insert_index = std::move(*--A_index);
+                    if (A_index == first1) break;
+
+                    if (++A_count == merge_gallop) {
+                        RandomAccessIterator1 A_next = FindLastGallopBackward(first1, A_index, *(B_index - 1), compare);
+                        insert_index = std::move_backward(A_next, A_index, insert_index);
+                        A_index = A_next;
+                        A_count = 0;
+                        if (A_index == first1) break;
+                    }
                 } else {
-                    *insert_index = *B_index;
-                    ++B_index;
-                    ++insert_index;
-                    if (B_index == B_last) break;
+                    *--insert_index = std::move(*--B_index);
+                    if (B_index == cache) break;
+                    A_count = 0;
                 }
             }
         }
 
-        // copy the remainder of A into the final array
-        std::copy(A_index, A_last, insert_index);
+        // copy the remainder of B into the final array
+        std::move_backward(cache, B_index, insert_index);
     }
 
     // merge operation using an internal buffer
@@ -211,17 +751,36 @@ namespace Wiki {
         RandomAccessIterator insert_index = first1;
 
         if (last2 - first2 > 0 && last1 - first1 > 0) {
+            std::size_t A_count = 0, B_count = 0;
             while (true) {
                 if (!compare(*B_index, *A_index)) {
                     std::iter_swap(insert_index, A_index);
                     ++A_index;
                     ++insert_index;
                     if (A_index == A_last) break;
+
+                    B_count = 0;
+                    if (++A_count == merge_gallop) {
+                        RandomAccessIterator A_next = FindLastGallop(A_index, A_last, *B_index, compare);
+                        insert_index = std::swap_ranges(A_index, A_next, insert_index);
+                        A_index = A_next;
+                        A_count = 0;
+                        if (A_index == A_last) break;
+                    }
                 } else {
                     std::iter_swap(insert_index, B_index);
                     ++B_index;
                     ++insert_index;
                     if (B_index == B_last) break;
+
+                    A_count = 0;
+                    if (++B_count == merge_gallop) {
+                        // not swap_ranges, since insert_index can catch up with where B_index was
+                        RandomAccessIterator B_next = FindFirstGallop(B_index, B_last, *A_index, compare);
+                        for (; B_index != B_next; ++B_index, ++insert_index) std::iter_swap(insert_index, B_index);
+                        B_count = 0;
+                        if (B_index == B_last) break;
+                    }
                 }
             }
         }
@@ -230,6 +789,39 @@ namespace Wiki {
         std::swap_ranges(A_index, A_last, insert_index);
     }
 
+    // SymMerge from Kim and Kutzner's "Stable Minimum Storage Merging by Symmetric Comparisons":
+    // find the split around the middle of the whole range where a suffix of A and a prefix of B need to trade places,
+    // rotate them, then merge the two halves the same way. this takes O(m log(n/m + 1)) comparisons for sizes m <= n,
+    // which is the lower bound for merging, O((m + n) log m) moves, and only O(log(m + n)) stack space
+    template <typename RandomAccessIterator, typename Comparison>
+    void SymMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare) {
+        // a single item on either side just needs to be binary searched for and rotated into place
+        if (middle - first == 1) {
+            std::rotate(first, middle, LowerBound(middle, last, *first, compare));
+            return;
+        }
+        if (last - middle == 1) {
+            std::rotate(UpperBound(first, middle, *middle, compare), middle, last);
+            return;
+        }
+
+        const std::ptrdiff_t size = last - first, half = size/2, split = middle - first, total = half + split;
+
+        // items at start and total - 1 - start are mirrored around the middle of the range,
+        // so search for the first pair of them that's out of order
+        std::ptrdiff_t start = (split > half) ? total - size : 0, end = std::min(split, half);
+        while (start < end) {
+            std::ptrdiff_t mid = start + (end - start)/2;
+            if (!compare(first[total - 1 - mid], first[mid])) start = mid + 1;
+            else end = mid;
+        }
+        end = total - start;
+
+        if (start < split && split < end) std::rotate(first + start, middle, first + end);
+        if (0 < start && start < half) SymMerge(first, first + start, first + half, compare);
+        if (half < end && end < size) SymMerge(first + half, first + end, last, compare);
+    }
+
     // merge operation without a buffer
     template <typename RandomAccessIterator, typename Comparison>
     void MergeInPlace(RandomAccessIterator first1, RandomAccessIterator last1,
@@ -238,39 +830,39 @@ namespace Wiki {
         if (last1 - first1 == 0 || last2 - first2 == 0) return;
 
         /*
-         this just repeatedly binary searches into B and rotates A into position.
-         the paper suggests using the 'rotation-based Hwang and Lin algorithm' here,
-         but I decided to stick with this because it had better situational performance
-
-         (Hwang and Lin is designed for merging subarrays of very different sizes,
-         but WikiSort almost always uses subarrays that are roughly the same size)
-
-         normally this is incredibly suboptimal, but this function is only called
-         when none of the A or B blocks in any subarray contained 2√A unique values,
-         which places a hard limit on the number of times this will ACTUALLY need
-         to binary search and rotate.
-
-         according to my analysis the worst case is √A rotations performed on √A items
-         once the constant factors are removed, which ends up being O(n)
-
-         again, this is NOT a general-purpose solution – it only works well in this case!
-         kind of like how the O(n^2) insertion sort is used in some places
+         this starts by repeatedly binary searching into B and rotating A into position.
+         this is only called when none of the A or B blocks in any subarray contained 2√A unique values,
+         and rotating each unique value in A into place is very fast when there are only a few of them,
+         but with just under 2√A unique values it can take √A rotations of up to the entire range.
+
+         so once the rotations have moved more items than are in both ranges, this switches over to SymMerge
+         for the rest of A, which is guaranteed to be O(m log(n/m + 1)) comparisons and O(n log m) moves
+         no matter how many unique values there are
          */
 
+        const std::size_t limit = last2 - first1;
+        std::size_t moved = 0;
+
         while (true) {
+            if (moved > limit) {
+                SymMerge(first1, last1, last2, compare);
+                break;
+            }
+
             // find the first place in B where the first item in A needs to be inserted
-            RandomAccessIterator mid = std::lower_bound(first2, last2, *first1, compare);
+            RandomAccessIterator mid = LowerBound(first2, last2, *first1, compare);
 
             // rotate A into place
             std::size_t amount = mid - last1;
             std::rotate(first1, last1, mid);
+            moved += mid - first1;
             if (last2 == mid) break;
 
             // calculate the new A and B ranges
             first2 = mid;
             first1 += amount;
             last1 = first2;
-            first1 = std::upper_bound(first1, last1, *first1, compare);
+            first1 = UpperBound(first1, last1, *first1, compare);
             if (std::distance(first1, last1) == 0) break;
         }
     }
@@ -282,6 +874,7 @@ namespace Wiki {
         std::size_t size, power_of_two;
         std::size_t decimal, numerator, denominator;
         std::size_t decimal_step, numerator_step;
+        std::size_t range_count;
 
     public:
 
@@ -292,13 +885,21 @@ namespace Wiki {
             numerator(0),
             denominator(power_of_two / min_level),
             decimal_step(size / denominator),
-            numerator_step(size % denominator)
+            numerator_step(size % denominator),
+            range_count(denominator)
         {}
 
         void begin() {
             numerator = decimal = 0;
         }
 
+        // jump straight to the range at the given index within this level,
+        // which is where nextRange() would be after being called 'index' times
+        void seek(std::size_t index) {
+            decimal = index * decimal_step + (index * numerator_step) / denominator;
+            numerator = (index * numerator_step) % denominator;
+        }
+
         template <typename Iterator>
         Range<Iterator> nextRange(Iterator it) {
             std::size_t start = decimal;
@@ -324,6 +925,7 @@ namespace Wiki {
                 numerator_step -= denominator;
                 ++decimal_step;
             }
+            range_count /= 2;
 
             return decimal_step < size;
         }
@@ -331,642 +933,2517 @@ namespace Wiki {
         std::size_t length() const {
             return decimal_step;
         }
+
+        // the number of ranges within this level (always a power of two)
+        std::size_t ranges() const {
+            return range_count;
+        }
     };
 
-#if DYNAMIC_CACHE
-    // use a class so the memory for the cache is freed when the object goes out of scope,
-    // regardless of whether exceptions were thrown (only needed in the C++ version)
-    template <typename T>
-    class Cache {
+    // the A and B subarrays for ranges [from, to) within the current level of the merge sort,
+    // so the merge steps below can be run over a whole level or handed a slice of one
+    template <typename RandomAccessIterator>
+    class Level {
+        Wiki::Iterator iterator;
+        RandomAccessIterator first;
+        std::size_t from, to, index;
+
     public:
-        T *cache;
-        std::size_t cache_size;
 
-        ~Cache() {
-            if (cache) delete[] cache;
+        Level(const Wiki::Iterator & iterator, RandomAccessIterator first):
+            iterator(iterator),
+            first(first),
+            from(0),
+            to(iterator.ranges()),
+            index(0)
+        {}
+
+        Level(const Wiki::Iterator & iterator, RandomAccessIterator first, std::size_t from, std::size_t to):
+            iterator(iterator),
+            first(first),
+            from(from),
+            to(to),
+            index(from)
+        {}
+
+        void begin() {
+            iterator.seek(from);
+            index = from;
         }
 
-        Cache(std::size_t size) {
-            // good choices for the cache size are:
-            // (size + 1)/2 – turns into a full-speed standard merge sort since everything fits into the cache
-            cache_size = (size + 1)/2;
-            cache = new (std::nothrow) T[cache_size];
-            if (cache) return;
+        Range<RandomAccessIterator> nextRange() {
+            ++index;
+            return iterator.nextRange(first);
+        }
 
-            // sqrt((size + 1)/2) + 1 – this will be the size of the A blocks at the largest level of merges,
-            // so a buffer of this size would allow it to skip using internal or in-place merges for anything
-            cache_size = std::sqrt(cache_size) + 1;
-            cache = new (std::nothrow) T[cache_size];
-            if (cache) return;
+        bool finished() const {
+            return index >= to;
+        }
 
-            // 512 – chosen from careful testing as a good balance between fixed-size memory use and run time
-            if (cache_size > 512) {
-                cache_size = 512;
-                cache = new (std::nothrow) T[cache_size];
-                if (cache) return;
-            }
+        // how many ranges are left before finished() is true
+        std::size_t remaining() const {
+            return to - index;
+        }
 
-            // 0 – if the system simply cannot allocate any extra memory whatsoever, no memory works just fine
-            cache_size = 0;
+        // only go through the A and B pairs from first_pair up to last_pair, counting from the first pair
+        void narrow(std::size_t first_pair, std::size_t last_pair) {
+            to = from + last_pair * 2;
+            from += first_pair * 2;
+            index = from;
+        }
+
+        std::size_t length() const {
+            return iterator.length();
+        }
+
+        // where the first A subarray starts
+        RandomAccessIterator start() const {
+            Wiki::Iterator it (iterator);
+            it.seek(from);
+            return it.nextRange(first).start;
         }
     };
-#endif
 
-    // bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use
-    template <typename RandomAccessIterator, typename Comparison>
-    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
-        // map first and last to a C-style array, so we don't have to change the rest of the code
-        // (bit of a nasty hack, but it's good enough for now...)
-        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
-        const std::size_t size = std::distance(first, last);
+    // a single pair of A and B subarrays, of any lengths, to be merged using the same steps as a whole level
+    template <typename RandomAccessIterator>
+    class Pair {
+        Range<RandomAccessIterator> A, B;
+        std::size_t index;
 
-        // if the array is of size 0, 1, 2, or 3, just sort them like so:
-        if (size < 4) {
-            if (size == 3) {
-                // hard-coded insertion sort
-                if (compare(first[1], first[0])) {
-                    std::iter_swap(first + 0, first + 1);
-                }
-                if (compare(first[2], first[1])) {
-                    std::iter_swap(first + 1, first + 2);
-                    if (compare(first[1], first[0])) {
-                        std::iter_swap(first + 0, first + 1);
-                    }
-                }
-            } else if (size == 2) {
-                // swap the items if they're out of order
-                if (compare(first[1], first[0])) {
-                    std::iter_swap(first + 0, first + 1);
-                }
-            }
+    public:
 
-            return;
+        Pair(Range<RandomAccessIterator> A, Range<RandomAccessIterator> B):
+            A(A),
+            B(B),
+            index(0)
+        {}
+
+        void begin() {
+            index = 0;
         }
 
-        // sort groups of 4-8 items at a time using an unstable sorting network,
-        // but keep track of the original item orders to force it to be stable
-        // http://pages.ripco.net/~jgamble/nw.html
-        Wiki::Iterator iterator (size, 4);
-        while (!iterator.finished()) {
-            int order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
-            Range<RandomAccessIterator> range = iterator.nextRange(first);
-
-            #define SWAP(x, y) \
-                if (compare(range.start[y], range.start[x]) || \
-                    (order[x] > order[y] && !compare(range.start[x], range.start[y]))) { \
-                    std::iter_swap(range.start + x, range.start + y); \
-                    std::iter_swap(order + x, order + y); }
-
-            if (range.length() == 8) {
-                SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
-                SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
-                SWAP(1, 2); SWAP(5, 6); SWAP(0, 4); SWAP(3, 7);
-                SWAP(1, 5); SWAP(2, 6);
-                SWAP(1, 4); SWAP(3, 6);
-                SWAP(2, 4); SWAP(3, 5);
-                SWAP(3, 4);
-
-            } else if (range.length() == 7) {
-                SWAP(1, 2); SWAP(3, 4); SWAP(5, 6);
-                SWAP(0, 2); SWAP(3, 5); SWAP(4, 6);
-                SWAP(0, 1); SWAP(4, 5); SWAP(2, 6);
-                SWAP(0, 4); SWAP(1, 5);
-                SWAP(0, 3); SWAP(2, 5);
-                SWAP(1, 3); SWAP(2, 4);
-                SWAP(2, 3);
-
-            } else if (range.length() == 6) {
-                SWAP(1, 2); SWAP(4, 5);
-                SWAP(0, 2); SWAP(3, 5);
-                SWAP(0, 1); SWAP(3, 4); SWAP(2, 5);
-                SWAP(0, 3); SWAP(1, 4);
-                SWAP(2, 4); SWAP(1, 3);
-                SWAP(2, 3);
-
-            } else if (range.length() == 5) {
-                SWAP(0, 1); SWAP(3, 4);
-                SWAP(2, 4);
-                SWAP(2, 3); SWAP(1, 4);
-                SWAP(0, 3);
-                SWAP(0, 2); SWAP(1, 3);
-                SWAP(1, 2);
-
-            } else if (range.length() == 4) {
-                SWAP(0, 1); SWAP(2, 3);
-                SWAP(0, 2); SWAP(1, 3);
-                SWAP(1, 2);
-            }
+        Range<RandomAccessIterator> nextRange() {
+            return (index++ == 0) ? A : B;
+        }
 
-            #undef SWAP
+        bool finished() const {
+            return index >= 2;
         }
-        if (size < 8) return;
 
-        // use a small cache to speed up some of the operations
-        #if DYNAMIC_CACHE
-            Cache<T> cache_obj (size);
-            T *cache = cache_obj.cache;
-            const std::size_t cache_size = cache_obj.cache_size;
-        #else
-            // since the cache size is fixed, it's still O(1) memory!
-            // just keep in mind that making it too small ruins the point (nothing will fit into it),
-            // and making it too large also ruins the point (so much for "low memory"!)
-            // removing the cache entirely still gives 75% of the performance of a standard merge
-            const std::size_t cache_size = 512;
-            T cache[cache_size];
-        #endif
+        std::size_t remaining() const {
+            return 2 - index;
+        }
 
-        // then merge sort the higher levels, which can be 8-15, 16-31, 32-63, 64-127, etc.
-        while (true) {
-            // if every A and B block will fit into the cache, use a special branch specifically for merging with the cache
-            // (we use < rather than <= since the block size might be one more than iterator.length())
-            if (iterator.length() < cache_size) {
+        // there's only the one pair to go through
+        void narrow(std::size_t, std::size_t) {}
 
-                // if four subarrays fit into the cache, it's faster to merge both pairs of subarrays into the cache,
-                // then merge the two merged subarrays from the cache back into the original array
-                if ((iterator.length() + 1) * 4 <= cache_size && iterator.length() * 4 <= size) {
-                    iterator.begin();
-                    while (!iterator.finished()) {
-                        // merge A1 and B1 into the cache
-                        Range<RandomAccessIterator> A1 = iterator.nextRange(first);
-                        Range<RandomAccessIterator> B1 = iterator.nextRange(first);
-                        Range<RandomAccessIterator> A2 = iterator.nextRange(first);
-                        Range<RandomAccessIterator> B2 = iterator.nextRange(first);
-
-                        if (compare(*(B1.end - 1), *A1.start)) {
-                            // the two ranges are in reverse order, so copy them in reverse order into the cache
-                            std::copy(A1.start, A1.end, cache + B1.length());
-                            std::copy(B1.start, B1.end, cache);
-                        } else if (compare(*B1.start, *(A1.end - 1))) {
-                            // these two ranges weren't already in order, so merge them into the cache
-                            std::merge(A1.start, A1.end, B1.start, B1.end, cache, compare);
-                        } else {
-                            // if A1, B1, A2, and B2 are all in order, skip doing anything else
-                            if (!compare(*B2.start, *(A2.end - 1)) &&
-                                !compare(*A2.start, *(B1.end - 1))) continue;
+        // the block and buffer sizes are based on the A subarray, since that's what gets broken into blocks
+        std::size_t length() const {
+            return A.length();
+        }
 
-                            // copy A1 and B1 into the cache in the same order
-                            std::copy(A1.start, A1.end, cache);
-                            std::copy(B1.start, B1.end, cache + A1.length());
-                        }
-                        A1 = Range<RandomAccessIterator>(A1.start, B1.end);
-
-                        // merge A2 and B2 into the cache
-                        if (compare(*(B2.end - 1), *A2.start)) {
-                            // the two ranges are in reverse order, so copy them in reverse order into the cache
-                            std::copy(A2.start, A2.end, cache + A1.length() + B2.length());
-                            std::copy(B2.start, B2.end, cache + A1.length());
-                        } else if (compare(*B2.start, *(A2.end - 1))) {
-                            // these two ranges weren't already in order, so merge them into the cache
-                            std::merge(A2.start, A2.end, B2.start, B2.end, cache + A1.length(), compare);
-                        } else {
-                            // copy A2 and B2 into the cache in the same order
-                            std::copy(A2.start, A2.end, cache + A1.length());
-                            std::copy(B2.start, B2.end, cache + A1.length() + A2.length());
-                        }
-                        A2 = Range<RandomAccessIterator>(A2.start, B2.end);
-
-                        // merge A1 and A2 from the cache into the array
-                        Range<T*> A3(cache, cache + A1.length());
-                        Range<T*> B3(cache + A1.length(), cache + A1.length() + A2.length());
-
-                        if (compare(*(B3.end - 1), *A3.start)) {
-                            // the two ranges are in reverse order, so copy them in reverse order into the array
-                            std::copy(A3.start, A3.end, A1.start + A2.length());
-                            std::copy(B3.start, B3.end, A1.start);
-                        } else if (compare(*B3.start, *(A3.end - 1))) {
-                            // these two ranges weren't already in order, so merge them back into the array
-                            std::merge(A3.start, A3.end, B3.start, B3.end, A1.start, compare);
+        RandomAccessIterator start() const {
+            return A.start;
+        }
+    };
+
+    // a cache of a fixed number of bytes on the stack, which holds as many items of type T as fit
+    // pass StackCache<bytes>() to Sort to use a different size than WIKISORT_CACHE_BYTES for that call
+    template <std::size_t bytes>
+    struct StackCache {
+        template <typename T>
+        struct Items {
+            static const std::size_t value = bytes/sizeof(T);
+        };
+    };
+
+    // uninitialized stack memory for a fixed number of items, which can be empty if the items are too large to fit into any
+    template <typename T, std::size_t count>
+    struct StackArray {
+        alignas(T) unsigned char memory[count * sizeof(T)];
+        void * data() { return memory; }
+    };
+
+    template <typename T>
+    struct StackArray<T, 0> {
+        void * data() { return NULL; }
+    };
+
+    // the sort moves items into and out of its cache, so the cache needs to hold actual objects. but rather than
+    // requiring a default constructor (and default constructing hundreds of items), each one is move constructed
+    // from an item in the array, which immediately gets its value moved back. trivial types can use the memory as-is
+    template <typename T>
+    class CacheItems {
+        static const bool trivial = std::is_trivial<T>::value;
+
+        T *items;
+        std::size_t count;
+
+        CacheItems(const CacheItems &);
+        CacheItems & operator=(const CacheItems &);
+
+        void destroy() {
+            if (trivial) return;
+            while (count > 0) items[--count].~T();
+        }
+
+    public:
+        template <typename RandomAccessIterator>
+        CacheItems(void *memory, std::size_t size, RandomAccessIterator from):
+            items((T *)memory),
+            count(trivial ? size : 0)
+        {
+            if (trivial) return;
+            try {
+                for (; count < size ; ++from) {
+                    new (items + count) T(std::move(*from));
+                    ++count;
+                    *from = std::move(items[count - 1]);
+                }
+            } catch (...) {
+                destroy();
+                throw;
+            }
+        }
+
+        ~CacheItems() {
+            destroy();
+        }
+
+        T * data() const { return items; }
+        std::size_t size() const { return count; }
+    };
+
+    // how much extra memory Sort is allowed to use for its cache, chosen per call at runtime
+    // the larger the cache, the more of the merges it can do there rather than in-place,
+    // until at (size + 1)/2 items it turns into a full-speed standard merge sort
+    class CachePolicy {
+    public:
+        enum Mode {
+            Fixed,      // WIKISORT_CACHE_BYTES on the stack, so it's still O(1) memory
+            SquareRoot, // sqrt((size + 1)/2) + 1 items, which fits every A block at the largest level of merges
+            Half,       // (size + 1)/2 items, which fits everything
+            Budget      // as many items as fit into the given number of bytes
+        };
+
+        Mode mode;
+        std::size_t bytes;
+
+        CachePolicy(Mode mode = Fixed, std::size_t bytes = 0):
+            mode(mode),
+            bytes(bytes)
+        {}
+
+        static CachePolicy Bytes(std::size_t bytes) {
+            return CachePolicy(Budget, bytes);
+        }
+
+        // how many items the cache should hold when sorting 'size' items of type T
+        // (there's no point in more than (size + 1)/2, since A is never larger than that)
+        template <typename T>
+        std::size_t items(std::size_t size) const {
+            const std::size_t half = (size + 1)/2;
+            switch (mode) {
+                case SquareRoot: return std::min(half, (std::size_t)std::sqrt(half) + 1);
+                case Half: return half;
+                case Budget: return std::min(half, bytes/sizeof(T));
+                default: return std::min(half, (std::size_t)(WIKISORT_CACHE_BYTES/sizeof(T)));
+            }
+        }
+    };
+
+    // grow-only scratch memory for the cache, kept for each thread so that repeated sorts don't need to allocate
+    // the memory is only freed when the thread exits (or Wiki::ReleaseCache() is called from that thread)
+    class Arena {
+        void *memory;
+        std::size_t bytes;
+        bool in_use;
+
+        Arena(const Arena &);
+        Arena & operator=(const Arena &);
+
+    public:
+        Arena():
+            memory(NULL),
+            bytes(0),
+            in_use(false)
+        {}
+
+        ~Arena() {
+            ::operator delete(memory);
+        }
+
+        static Arena & local() {
+            static thread_local Arena arena;
+            return arena;
+        }
+
+        // get at least 'size' bytes of uninitialized memory, growing the arena if needed
+        // returns NULL if the memory is already in use (a sort called from within a comparison), or if it can't grow
+        void * acquire(std::size_t size) {
+            if (in_use || size == 0) return NULL;
+            if (size > bytes) {
+                ::operator delete(memory);
+                memory = ::operator new(size, std::nothrow);
+                bytes = memory ? size : 0;
+                if (!memory) return NULL;
+            }
+            in_use = true;
+            return memory;
+        }
+
+        void release() {
+            in_use = false;
+        }
+
+        std::size_t capacity() const {
+            return bytes;
+        }
+
+        void clear() {
+            if (in_use) return;
+            ::operator delete(memory);
+            memory = NULL;
+            bytes = 0;
+        }
+    };
+
+    // free the memory the calling thread kept around for the caches of previous sorts
+    inline void ReleaseCache() {
+        Arena::local().clear();
+    }
+
+    // with overcommit, new (std::nothrow) almost never fails, so a cache that's too large for the machine (or for the
+    // container's memory limit) gets the process killed rather than falling back to a smaller cache.
+    // so large caches are limited to what the memory budget allows, and to half of the memory that's actually left
+    inline std::atomic<std::size_t> & CacheBudgetBytes() {
+        static std::atomic<std::size_t> bytes (std::numeric_limits<std::size_t>::max());
+        return bytes;
+    }
+
+    // set the most memory any one cache can use, in bytes, across all threads
+    inline void SetCacheBudget(std::size_t bytes) {
+        CacheBudgetBytes().store(bytes);
+    }
+
+#if defined(__linux__)
+    // read the number at the start of a file like /sys/fs/cgroup/memory.max, or 0 if there isn't one (or it says "max")
+    inline std::size_t ReadBytes(const char *path) {
+        std::ifstream file (path);
+        unsigned long long value = 0;
+        if (!(file >> value)) return 0;
+        return (std::size_t)std::min(value, (unsigned long long)std::numeric_limits<std::size_t>::max());
+    }
+
+    // read a field like "MemAvailable:  123456 kB" from /proc/meminfo, in bytes, or 0 if it isn't there
+    inline std::size_t ReadMemInfo(const std::string & field) {
+        std::ifstream file ("/proc/meminfo");
+        std::string name, unit;
+        unsigned long long value;
+        while (file >> name >> value) {
+            std::getline(file, unit);
+            if (name == field + ":") return value * 1024;
+        }
+        return 0;
+    }
+
+    // this process's cgroup, from a line like "0::/system.slice/example.service" in /proc/self/cgroup,
+    // where cgroup v2 has the one hierarchy with no controllers listed, and v1 has one for each set of controllers
+    inline std::string CgroupPath(bool v2) {
+        std::ifstream file ("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(file, line)) {
+            std::size_t first = line.find(':'), second = line.find(':', first + 1);
+            if (first == std::string::npos || second == std::string::npos) continue;
+
+            std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+            if (v2 ? (controllers == ",,") : (controllers.find(",memory,") != std::string::npos))
+                return line.substr(second + 1);
+        }
+        return "/";
+    }
+
+    // the least memory left under the limits of the cgroup and each of its ancestors, since all of them apply to it
+    // (the mount point is the root of this process's cgroup namespace, which is only its own cgroup in a container)
+    inline std::size_t CgroupHeadroom(const std::string & mount, std::string path,
+                                      const std::string & limit_file, const std::string & usage_file) {
+        std::size_t headroom = std::numeric_limits<std::size_t>::max();
+        while (true) {
+            std::string directory = mount + (path == "/" ? "" : path) + "/";
+            std::size_t limit = ReadBytes((directory + limit_file).c_str());
+            if (limit > 0) {
+                std::size_t usage = ReadBytes((directory + usage_file).c_str());
+                headroom = std::min(headroom, (limit > usage) ? limit - usage : 0);
+            }
+
+            if (path.size() <= 1) break;
+            path.erase(path.rfind('/'));
+            if (path.empty()) path = "/";
+        }
+        return headroom;
+    }
+#endif
+
+    // how much more memory this process can use, from the cgroup memory limit and the system's available memory
+    inline std::size_t MemoryHeadroom() {
+        std::size_t headroom = std::numeric_limits<std::size_t>::max();
+    #if defined(__linux__)
+        // cgroup v2 first, then v1
+        headroom = CgroupHeadroom("/sys/fs/cgroup", CgroupPath(true), "memory.max", "memory.current");
+        if (headroom == std::numeric_limits<std::size_t>::max()) {
+            headroom = CgroupHeadroom("/sys/fs/cgroup/memory", CgroupPath(false),
+                                      "memory.limit_in_bytes", "memory.usage_in_bytes");
+        }
+
+        std::size_t available = ReadMemInfo("MemAvailable");
+        if (available > 0) headroom = std::min(headroom, available);
+    #endif
+        return headroom;
+    }
+
+    // the most memory a cache that wants 'bytes' can safely use
+    inline std::size_t CacheLimit(std::size_t bytes) {
+        bytes = std::min(bytes, CacheBudgetBytes().load());
+
+        // small caches can't make a difference, and reading the limits takes a few system calls,
+        // so only check them for larger caches, which are for sorts that take far longer than that anyway.
+        // memory the arena already has is already accounted for, so it's safe to reuse
+        const std::size_t small = 1 << 20;
+        if (bytes <= small || bytes <= Arena::local().capacity()) return bytes;
+        return std::max(small, std::min(bytes, MemoryHeadroom()/2));
+    }
+
+    // use a class so the memory for the cache is released when the object goes out of scope,
+    // regardless of whether exceptions were thrown (only needed in the C++ version)
+    // the memory is uninitialized, so it still needs CacheItems to hold the items
+    template <typename T>
+    class Cache {
+        // the arena's memory only has the default alignment, so over-aligned types allocate their own
+        static const bool arena_aligned = alignof(T) <= alignof(std::max_align_t);
+
+        bool from_arena;
+        void *allocation;
+
+        Cache(const Cache &);
+        Cache & operator=(const Cache &);
+
+        bool allocate(std::size_t count) {
+            cache_size = count;
+            memory = arena_aligned ? Arena::local().acquire(count * sizeof(T)) : NULL;
+            if (memory) {
+                from_arena = true;
+                return true;
+            }
+
+            std::size_t bytes = count * sizeof(T) + alignof(T);
+            allocation = ::operator new(bytes, std::nothrow);
+            if (!allocation) return false;
+            memory = allocation;
+            std::align(alignof(T), count * sizeof(T), memory, bytes);
+            return true;
+        }
+
+    public:
+        void *memory;
+        std::size_t cache_size;
+
+        ~Cache() {
+            if (from_arena) Arena::local().release();
+            else ::operator delete(allocation);
+        }
+
+        Cache(std::size_t size, CachePolicy policy):
+            from_arena(false),
+            allocation(NULL),
+            memory(NULL)
+        {
+            // try for the size the policy asks for first, as far as the memory budget allows
+            std::size_t wanted = policy.items<T>(size);
+            if (allocate(std::min(wanted, CacheLimit(wanted * sizeof(T))/sizeof(T)))) return;
+
+            // if that fails, fall back to smaller sizes that are still good choices:
+            // sqrt((size + 1)/2) + 1 – this will be the size of the A blocks at the largest level of merges,
+            // so a buffer of this size would allow it to skip using internal or in-place merges for anything
+            std::size_t root = std::sqrt((size + 1)/2) + 1;
+            if (cache_size > root && allocate(root)) return;
+
+            // 512 – chosen from careful testing as a good balance between fixed-size memory use and run time
+            if (cache_size > 512 && allocate(512)) return;
+
+            // 0 – if the system simply cannot allocate any extra memory whatsoever, no memory works just fine
+            cache_size = 0;
+        }
+    };
+
+    // sort a group of 4-8 items using an unstable sorting network,
+    // but keep track of the original item orders to force it to be stable
+    // http://pages.ripco.net/~jgamble/nw.html
+    template <typename RandomAccessIterator, typename Comparison>
+    void NetworkSort(Range<RandomAccessIterator> range, Comparison compare) {
+        int order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+        #define SWAP(x, y) \
+            if (compare(range.start[y], range.start[x]) || \
+                (order[x] > order[y] && !compare(range.start[x], range.start[y]))) { \
+                std::iter_swap(range.start + x, range.start + y); \
+                std::iter_swap(order + x, order + y); }
+
+        if (range.length() == 8) {
+            SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
+            SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
+            SWAP(1, 2); SWAP(5, 6); SWAP(0, 4); SWAP(3, 7);
+            SWAP(1, 5); SWAP(2, 6);
+            SWAP(1, 4); SWAP(3, 6);
+            SWAP(2, 4); SWAP(3, 5);
+            SWAP(3, 4);
+
+        } else if (range.length() == 7) {
+            SWAP(1, 2); SWAP(3, 4); SWAP(5, 6);
+            SWAP(0, 2); SWAP(3, 5); SWAP(4, 6);
+            SWAP(0, 1); SWAP(4, 5); SWAP(2, 6);
+            SWAP(0, 4); SWAP(1, 5);
+            SWAP(0, 3); SWAP(2, 5);
+            SWAP(1, 3); SWAP(2, 4);
+            SWAP(2, 3);
+
+        } else if (range.length() == 6) {
+            SWAP(1, 2); SWAP(4, 5);
+            SWAP(0, 2); SWAP(3, 5);
+            SWAP(0, 1); SWAP(3, 4); SWAP(2, 5);
+            SWAP(0, 3); SWAP(1, 4);
+            SWAP(2, 4); SWAP(1, 3);
+            SWAP(2, 3);
+
+        } else if (range.length() == 5) {
+            SWAP(0, 1); SWAP(3, 4);
+            SWAP(2, 4);
+            SWAP(2, 3); SWAP(1, 4);
+            SWAP(0, 3);
+            SWAP(0, 2); SWAP(1, 3);
+            SWAP(1, 2);
+
+        } else if (range.length() == 4) {
+            SWAP(0, 1); SWAP(2, 3);
+            SWAP(0, 2); SWAP(1, 3);
+            SWAP(1, 2);
+        }
+
+        #undef SWAP
+    }
+
+    // compare-and-swap operations on SIMD registers, where each lane holds an item from a different group of 4-8 items,
+    // so the sorting network above can be applied to many groups at the same time.
+    // each item also has its original position within its group in the matching lane of an 'Index' register,
+    // which is used to break ties between equal keys to keep the network stable. for integers, equal keys
+    // are indistinguishable so plain min/max is already stable, but floating-point has -0.0 == +0.0
+    template <typename T>
+    struct VectorLanes {
+        static const bool enabled = false;
+    };
+
+#if defined(__AVX512F__)
+    template <>
+    struct VectorLanes<int32_t> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 16;
+        typedef __m512i Vector;
+        typedef __m512i Index;
+
+        static Vector load(const int32_t *from) { return _mm512_load_si512(from); }
+        static void store(int32_t *to, Vector value) { _mm512_store_si512(to, value); }
+        static int32_t sentinel() { return std::numeric_limits<int32_t>::max(); }
+        static Index index(int) { return _mm512_setzero_si512(); }
+
+        static void order(Vector & a, Vector & b, Index &, Index &) {
+            Vector min = _mm512_min_epi32(a, b);
+            b = _mm512_max_epi32(a, b);
+            a = min;
+        }
+    };
+
+    template <>
+    struct VectorLanes<int64_t> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 8;
+        typedef __m512i Vector;
+        typedef __m512i Index;
+
+        static Vector load(const int64_t *from) { return _mm512_load_si512(from); }
+        static void store(int64_t *to, Vector value) { _mm512_store_si512(to, value); }
+        static int64_t sentinel() { return std::numeric_limits<int64_t>::max(); }
+        static Index index(int) { return _mm512_setzero_si512(); }
+
+        static void order(Vector & a, Vector & b, Index &, Index &) {
+            Vector min = _mm512_min_epi64(a, b);
+            b = _mm512_max_epi64(a, b);
+            a = min;
+        }
+    };
+
+    template <>
+    struct VectorLanes<float> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 16;
+        typedef __m512 Vector;
+        typedef __m512i Index;
+
+        static Vector load(const float *from) { return _mm512_load_ps(from); }
+        static void store(float *to, Vector value) { _mm512_store_ps(to, value); }
+        static float sentinel() { return std::numeric_limits<float>::infinity(); }
+        static Index index(int position) { return _mm512_set1_epi32(position); }
+
+        static void order(Vector & a, Vector & b, Index & index_a, Index & index_b) {
+            __mmask16 swap = _mm512_cmp_ps_mask(b, a, _CMP_LT_OQ) |
+                             (_mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ) & _mm512_cmpgt_epi32_mask(index_a, index_b));
+            Vector min = _mm512_mask_blend_ps(swap, a, b);
+            b = _mm512_mask_blend_ps(swap, b, a);
+            a = min;
+            Index min_index = _mm512_mask_blend_epi32(swap, index_a, index_b);
+            index_b = _mm512_mask_blend_epi32(swap, index_b, index_a);
+            index_a = min_index;
+        }
+    };
+
+    template <>
+    struct VectorLanes<double> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 8;
+        typedef __m512d Vector;
+        typedef __m512i Index;
+
+        static Vector load(const double *from) { return _mm512_load_pd(from); }
+        static void store(double *to, Vector value) { _mm512_store_pd(to, value); }
+        static double sentinel() { return std::numeric_limits<double>::infinity(); }
+        static Index index(int position) { return _mm512_set1_epi64(position); }
+
+        static void order(Vector & a, Vector & b, Index & index_a, Index & index_b) {
+            __mmask8 swap = _mm512_cmp_pd_mask(b, a, _CMP_LT_OQ) |
+                            (_mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ) & _mm512_cmpgt_epi64_mask(index_a, index_b));
+            Vector min = _mm512_mask_blend_pd(swap, a, b);
+            b = _mm512_mask_blend_pd(swap, b, a);
+            a = min;
+            Index min_index = _mm512_mask_blend_epi64(swap, index_a, index_b);
+            index_b = _mm512_mask_blend_epi64(swap, index_b, index_a);
+            index_a = min_index;
+        }
+    };
+#elif defined(__AVX2__)
+    template <>
+    struct VectorLanes<int32_t> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 8;
+        typedef __m256i Vector;
+        typedef __m256i Index;
+
+        static Vector load(const int32_t *from) { return _mm256_load_si256((const __m256i *)from); }
+        static void store(int32_t *to, Vector value) { _mm256_store_si256((__m256i *)to, value); }
+        static int32_t sentinel() { return std::numeric_limits<int32_t>::max(); }
+        static Index index(int) { return _mm256_setzero_si256(); }
+
+        static void order(Vector & a, Vector & b, Index &, Index &) {
+            Vector min = _mm256_min_epi32(a, b);
+            b = _mm256_max_epi32(a, b);
+            a = min;
+        }
+    };
+
+    template <>
+    struct VectorLanes<int64_t> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 4;
+        typedef __m256i Vector;
+        typedef __m256i Index;
+
+        static Vector load(const int64_t *from) { return _mm256_load_si256((const __m256i *)from); }
+        static void store(int64_t *to, Vector value) { _mm256_store_si256((__m256i *)to, value); }
+        static int64_t sentinel() { return std::numeric_limits<int64_t>::max(); }
+        static Index index(int) { return _mm256_setzero_si256(); }
+
+        // AVX2 has no 64-bit min or max, so compare and blend instead
+        static void order(Vector & a, Vector & b, Index &, Index &) {
+            Vector swap = _mm256_cmpgt_epi64(a, b);
+            Vector min = _mm256_blendv_epi8(a, b, swap);
+            b = _mm256_blendv_epi8(b, a, swap);
+            a = min;
+        }
+    };
+
+    template <>
+    struct VectorLanes<float> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 8;
+        typedef __m256 Vector;
+        typedef __m256i Index;
+
+        static Vector load(const float *from) { return _mm256_load_ps(from); }
+        static void store(float *to, Vector value) { _mm256_store_ps(to, value); }
+        static float sentinel() { return std::numeric_limits<float>::infinity(); }
+        static Index index(int position) { return _mm256_set1_epi32(position); }
+
+        static void order(Vector & a, Vector & b, Index & index_a, Index & index_b) {
+            Vector swap = _mm256_or_ps(_mm256_cmp_ps(b, a, _CMP_LT_OQ),
+                                       _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ),
+                                                     _mm256_castsi256_ps(_mm256_cmpgt_epi32(index_a, index_b))));
+            Vector min = _mm256_blendv_ps(a, b, swap);
+            b = _mm256_blendv_ps(b, a, swap);
+            a = min;
+            Index min_index = _mm256_blendv_epi8(index_a, index_b, _mm256_castps_si256(swap));
+            index_b = _mm256_blendv_epi8(index_b, index_a, _mm256_castps_si256(swap));
+            index_a = min_index;
+        }
+    };
+
+    template <>
+    struct VectorLanes<double> {
+        static const bool enabled = true;
+        static const std::size_t lanes = 4;
+        typedef __m256d Vector;
+        typedef __m256i Index;
+
+        static Vector load(const double *from) { return _mm256_load_pd(from); }
+        static void store(double *to, Vector value) { _mm256_store_pd(to, value); }
+        static double sentinel() { return std::numeric_limits<double>::infinity(); }
+        static Index index(int position) { return _mm256_set1_epi64x(position); }
+
+        static void order(Vector & a, Vector & b, Index & index_a, Index & index_b) {
+            Vector swap = _mm256_or_pd(_mm256_cmp_pd(b, a, _CMP_LT_OQ),
+                                       _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ),
+                                                     _mm256_castsi256_pd(_mm256_cmpgt_epi64(index_a, index_b))));
+            Vector min = _mm256_blendv_pd(a, b, swap);
+            b = _mm256_blendv_pd(b, a, swap);
+            a = min;
+            Index min_index = _mm256_blendv_epi8(index_a, index_b, _mm256_castpd_si256(swap));
+            index_b = _mm256_blendv_epi8(index_b, index_a, _mm256_castpd_si256(swap));
+            index_a = min_index;
+        }
+    };
+#endif
+
+    // the SIMD networks only work on a contiguous array of one of the types above, compared with std::less
+    template <typename RandomAccessIterator, typename Comparison>
+    struct VectorNetwork {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        static const bool enabled = VectorLanes<T>::enabled && Contiguous<RandomAccessIterator>::value &&
+            std::is_same<Comparison, std::less<T> >::value;
+    };
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void VectorNetworkSort(Level<RandomAccessIterator> &, Comparison, std::false_type) {}
+
+    // sort the groups of 4-8 items in batches of one group per SIMD lane: copy each group into a column of 'items'
+    // (padding it out to 8 with a sentinel that sorts after everything else), apply the network for 8 items
+    // to every column at once, then copy the first 4-8 items of each column back into their group
+    template <typename RandomAccessIterator, typename Comparison>
+    void VectorNetworkSort(Level<RandomAccessIterator> & level, Comparison, std::true_type) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        typedef VectorLanes<T> Lanes;
+        const std::size_t lanes = Lanes::lanes;
+
+        alignas(64) T items[8][lanes];
+        Range<RandomAccessIterator> ranges[lanes];
+        typename Lanes::Vector rows[8];
+        typename Lanes::Index positions[8];
+
+        while (level.remaining() >= lanes) {
+            for (std::size_t lane = 0; lane < lanes; ++lane) {
+                ranges[lane] = level.nextRange();
+                std::size_t length = ranges[lane].length(), index;
+                for (index = 0; index < length; ++index) items[index][lane] = ranges[lane].start[index];
+                for (; index < 8; ++index) items[index][lane] = Lanes::sentinel();
+            }
+
+            for (int index = 0; index < 8; ++index) {
+                rows[index] = Lanes::load(items[index]);
+                positions[index] = Lanes::index(index);
+            }
+
+            #define SWAP(x, y) Lanes::order(rows[x], rows[y], positions[x], positions[y])
+            SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
+            SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
+            SWAP(1, 2); SWAP(5, 6); SWAP(0, 4); SWAP(3, 7);
+            SWAP(1, 5); SWAP(2, 6);
+            SWAP(1, 4); SWAP(3, 6);
+            SWAP(2, 4); SWAP(3, 5);
+            SWAP(3, 4);
+            #undef SWAP
+
+            for (int index = 0; index < 8; ++index) Lanes::store(items[index], rows[index]);
+
+            for (std::size_t lane = 0; lane < lanes; ++lane) {
+                std::size_t length = ranges[lane].length();
+                for (std::size_t index = 0; index < length; ++index) ranges[lane].start[index] = items[index][lane];
+            }
+        }
+    }
+
+    // sort every group of 4-8 items within the level, using the SIMD networks when possible
+    template <typename RandomAccessIterator, typename Comparison>
+    void NetworkSortLevel(Level<RandomAccessIterator> level, Comparison compare) {
+        level.begin();
+        VectorNetworkSort(level, compare,
+                          std::integral_constant<bool, VectorNetwork<RandomAccessIterator, Comparison>::enabled>());
+        while (!level.finished()) {
+            NetworkSort(level.nextRange(), compare);
+        }
+    }
+
+    // merge two levels at once by merging both pairs of subarrays into the cache,
+    // then merging the two merged subarrays from the cache back into the original array
+    // (four subarrays need to fit into the cache for this to work)
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    void MergeLevelsWithCache(Level<RandomAccessIterator> level, T *cache, Comparison compare) {
+        level.begin();
+        while (!level.finished()) {
+            // merge A1 and B1 into the cache
+            Range<RandomAccessIterator> A1 = level.nextRange();
+            Range<RandomAccessIterator> B1 = level.nextRange();
+            Range<RandomAccessIterator> A2 = level.nextRange();
+            Range<RandomAccessIterator> B2 = level.nextRange();
+
+            if (compare(*(B1.end - 1), *A1.start)) {
+                // the two ranges are in reverse order, so copy them in reverse order into the cache
+                std::move(A1.start, A1.end, cache + B1.length());
+                std::move(B1.start, B1.end, cache);
+            } else if (compare(*B1.start, *(A1.end - 1))) {
+                // these two ranges weren't already in order, so merge them into the cache
+                MergeInto(A1.start, A1.end, B1.start, B1.end, cache, compare);
+            } else {
+                // if A1, B1, A2, and B2 are all in order, skip doing anything else
+                if (!compare(*B2.start, *(A2.end - 1)) &&
+                    !compare(*A2.start, *(B1.end - 1))) continue;
+
+                // copy A1 and B1 into the cache in the same order
+                std::move(A1.start, A1.end, cache);
+                std::move(B1.start, B1.end, cache + A1.length());
+            }
+            A1 = Range<RandomAccessIterator>(A1.start, B1.end);
+
+            // merge A2 and B2 into the cache
+            if (compare(*(B2.end - 1), *A2.start)) {
+                // the two ranges are in reverse order, so copy them in reverse order into the cache
+                std::move(A2.start, A2.end, cache + A1.length() + B2.length());
+                std::move(B2.start, B2.end, cache + A1.length());
+            } else if (compare(*B2.start, *(A2.end - 1))) {
+                // these two ranges weren't already in order, so merge them into the cache
+                MergeInto(A2.start, A2.end, B2.start, B2.end, cache + A1.length(), compare);
+            } else {
+                // copy A2 and B2 into the cache in the same order
+                std::move(A2.start, A2.end, cache + A1.length());
+                std::move(B2.start, B2.end, cache + A1.length() + A2.length());
+            }
+            A2 = Range<RandomAccessIterator>(A2.start, B2.end);
+
+            // merge A1 and A2 from the cache into the array
+            Range<T*> A3(cache, cache + A1.length());
+            Range<T*> B3(cache + A1.length(), cache + A1.length() + A2.length());
+
+            if (compare(*(B3.end - 1), *A3.start)) {
+                // the two ranges are in reverse order, so copy them in reverse order into the array
+                std::move(A3.start, A3.end, A1.start + A2.length());
+                std::move(B3.start, B3.end, A1.start);
+            } else if (compare(*B3.start, *(A3.end - 1))) {
+                // these two ranges weren't already in order, so merge them back into the array
+                MergeInto(A3.start, A3.end, B3.start, B3.end, A1.start, compare);
+            } else {
+                // copy A3 and B3 into the array in the same order
+                std::move(A3.start, A3.end, A1.start);
+                std::move(B3.start, B3.end, A1.start + A1.length());
+            }
+        }
+    }
+
+    // merge each A and B subarray within the level using the cache, which every A subarray fits into
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    void MergeLevelWithCache(Level<RandomAccessIterator> level, T *cache, Comparison compare) {
+        level.begin();
+        while (!level.finished()) {
+            Range<RandomAccessIterator> A = level.nextRange();
+            Range<RandomAccessIterator> B = level.nextRange();
+
+            if (compare(*(B.end - 1), *A.start)) {
+                // the two ranges are in reverse order, so a simple rotation should fix it
+                std::rotate(A.start, A.end, B.end);
+            } else if (compare(*B.start, *(A.end - 1))) {
+                // these two ranges weren't already in order, so we'll need to merge them!
+                std::move(A.start, A.end, cache);
+                MergeExternal(A.start, A.end, B.start, B.end, cache, compare);
+            }
+        }
+    }
+
+    // this is where the in-place merge logic starts!
+    // 1. pull out two internal buffers each containing √A unique values
+    //     1a. adjust block_size and buffer_size if we couldn't find enough unique values
+    // 2. loop over the A and B subarrays within this level of the merge sort
+    //     3. break A and B into blocks of size 'block_size'
+    //     4. "tag" each of the A blocks with values from the first internal buffer
+    //     5. roll the A blocks through the B blocks and drop/rotate them where they belong
+    //     6. merge each A block with any B values that follow, using the cache or the second internal buffer
+    // 7. sort the second internal buffer if it exists
+    // 8. redistribute the two internal buffers back into the array
+    template <template <typename> class Subarrays, typename RandomAccessIterator, typename T, typename Comparison>
+    void MergeLevelInPlace(Subarrays<RandomAccessIterator> level, T *cache, const std::size_t cache_size, Comparison compare) {
+        // a thread's slice of the level might not contain any A and B subarrays at all
+        if (level.finished()) return;
+
+        // handle the A and B pairs that are already in order (or only need a rotation) before the first one that needs
+        // merging, since pulling out the internal buffers and redistributing them again is wasted work for a level where
+        // none of the pairs need to be merged, and then the internal buffers only come from the pairs that are left.
+        // this stops at the first pair that needs merging, so the comparisons are never repeated below
+        std::size_t pairs = level.remaining()/2, first_merge = 0;
+        level.begin();
+        for (; first_merge < pairs; ++first_merge) {
+            Range<RandomAccessIterator> A = level.nextRange();
+            Range<RandomAccessIterator> B = level.nextRange();
+
+            if (compare(*(B.end - 1), *A.start)) {
+                std::rotate(A.start, A.end, B.end);
+            } else if (compare(*A.end, *(A.end - 1))) {
+                break;
+            }
+        }
+        if (first_merge == pairs) return;
+        level.narrow(first_merge, pairs);
+
+        std::size_t block_size = std::sqrt(level.length());
+        std::size_t buffer_size = level.length()/block_size + 1;
+
+        // as an optimization, we really only need to pull out the internal buffers once for each level of merges
+        // after that we can reuse the same buffers over and over, then redistribute it when we're finished with this level
+        Range<RandomAccessIterator> buffer1(level.start(), level.start());
+        Range<RandomAccessIterator> buffer2(buffer1);
+        RandomAccessIterator index, last;
+        std::size_t count, pull_index = 0;
+        struct
+        {
+            RandomAccessIterator from, to;
+            std::size_t count;
+            Range<RandomAccessIterator> range;
+        } pull[2];
+        pull[0].count = 0; pull[0].range = buffer1;
+        pull[1].count = 0; pull[1].range = buffer1;
+        pull[0].from = pull[0].to = pull[1].from = pull[1].to = buffer1.start;
+
+        // find two internal buffers of size 'buffer_size' each
+        // let's try finding both buffers at the same time from a single A or B subarray
+        std::size_t find = buffer_size + buffer_size;
+        bool find_separately = false;
+
+        if (block_size <= cache_size) {
+            // if every A block fits into the cache then we won't need the second internal buffer,
+            // so we really only need to find 'buffer_size' unique values
+            find = buffer_size;
+        } else if (find > level.length()) {
+            // we can't fit both buffers into the same A or B subarray, so find two buffers separately
+            find = buffer_size;
+            find_separately = true;
+        }
+
+        // we need to find either a single contiguous space containing 2√A unique values (which will be split up into two buffers of size √A each),
+        // or we need to find one buffer of < 2√A unique values, and a second buffer of √A unique values,
+        // OR if we couldn't find that many unique values, we need the largest possible buffer we can get
+
+        // in the case where it couldn't find a single buffer of at least √A unique values,
+        // all of the Merge steps must be replaced by a different merge algorithm (MergeInPlace)
+
+        level.begin();
+        while (!level.finished()) {
+            Range<RandomAccessIterator> A = level.nextRange();
+            Range<RandomAccessIterator> B = level.nextRange();
+
+            // just store information about where the values will be pulled from and to,
+            // as well as how many values there are, to create the two internal buffers
+            #define PULL(_to) \
+                pull[pull_index].range = Range<RandomAccessIterator>(A.start, B.end); \
+                pull[pull_index].count = count; \
+                pull[pull_index].from = index; \
+                pull[pull_index].to = _to
+
+            // check A for the number of unique values we need to fill an internal buffer
+            // these values will be pulled out to the start of A
+            for (last = A.start, count = 1; count < find; last = index, ++count) {
+                index = FindLastForward(last + 1, A.end, *last, compare, find - count);
+                if (index == A.end) break;
+                assert(index < A.end);
+            }
+            index = last;
+
+            if (count >= buffer_size) {
+                // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
+                PULL(A.start);
+                pull_index = 1;
+
+                if (count == buffer_size + buffer_size) {
+                    // we were able to find a single contiguous section containing 2√A unique values,
+                    // so this section can be used to contain both of the internal buffers we'll need
+                    buffer1 = Range<RandomAccessIterator>(A.start, A.start + buffer_size);
+                    buffer2 = Range<RandomAccessIterator>(A.start + buffer_size, A.start + count);
+                    break;
+                } else if (find == buffer_size + buffer_size) {
+                    // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
+                    // so we still need to find a second separate buffer of at least √A unique values
+                    buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                    find = buffer_size;
+                } else if (block_size <= cache_size) {
+                    // we found the first and only internal buffer that we need, so we're done!
+                    buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                    break;
+                } else if (find_separately) {
+                    // found one buffer, but now find the other one
+                    buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                    find_separately = false;
+                } else {
+                    // we found a second buffer in an 'A' subarray containing √A unique values, so we're done!
+                    buffer2 = Range<RandomAccessIterator>(A.start, A.start + count);
+                    break;
+                }
+            } else if (pull_index == 0 && count > buffer1.length()) {
+                // keep track of the largest buffer we were able to find
+                buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
+                PULL(A.start);
+            }
+
+            // check B for the number of unique values we need to fill an internal buffer
+            // these values will be pulled out to the end of B
+                for (last = B.end - 1, count = 1; count < find; last = index - 1, ++count) {
+                    index = FindFirstBackward(B.start, last, *last, compare, find - count);
+                    if (index == B.start) break;
+                    assert(index > B.start);
+                }
+                index = last;
+
+            if (count >= buffer_size) {
+                // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
+                PULL(B.end);
+                pull_index = 1;
+
+                if (count == buffer_size + buffer_size) {
+                    // we were able to find a single contiguous section containing 2√A unique values,
+                    // so this section can be used to contain both of the internal buffers we'll need
+                    buffer1 = Range<RandomAccessIterator>(B.end - count, B.end - buffer_size);
+                    buffer2 = Range<RandomAccessIterator>(B.end - buffer_size, B.end);
+                    break;
+                } else if (find == buffer_size + buffer_size) {
+                    // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
+                    // so we still need to find a second separate buffer of at least √A unique values
+                    buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
+                    find = buffer_size;
+                } else if (block_size <= cache_size) {
+                    // we found the first and only internal buffer that we need, so we're done!
+                    buffer1 = Range<RandomAccessIterator>(B.end - count, B.end );
+                    break;
+                } else if (find_separately) {
+                    // found one buffer, but now find the other one
+                    buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
+                    find_separately = false;
+                } else {
+                    // buffer2 will be pulled out from a 'B' subarray, so if the first buffer was pulled out from the corresponding 'A' subarray,
+                    // we need to adjust the end point for that A subarray so it knows to stop redistributing its values before reaching buffer2
+                    if (pull[0].range.start == A.start) {
+                        pull[0].range.end -= pull[1].count;
+                    }
+
+                    // we found a second buffer in a 'B' subarray containing √A unique values, so we're done!
+                    buffer2 = Range<RandomAccessIterator>(B.end - count, B.end);
+                    break;
+                }
+            } else if (pull_index == 0 && count > buffer1.length()) {
+                // keep track of the largest buffer we were able to find
+                buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
+                PULL(B.end);
+            }
+
+            #undef PULL
+        }
+
+        // pull out the two ranges so we can use them as internal buffers
+        for (pull_index = 0; pull_index < 2; ++pull_index) {
+            std::size_t length = pull[pull_index].count;
+
+            if (pull[pull_index].to < pull[pull_index].from) {
+                // we're pulling the values out to the left, which means the start of an A subarray
+                index = pull[pull_index].from;
+                for (count = 1; count < length; ++count) {
+                    index = FindFirstBackward(pull[pull_index].to, pull[pull_index].from - (count - 1),
+                                              *(index - 1), compare, length - count);
+                    Range<RandomAccessIterator> range(index + 1, pull[pull_index].from + 1);
+                    std::rotate(range.start, range.end - count, range.end);
+                    pull[pull_index].from = index + count;
+                }
+            } else if (pull[pull_index].to > pull[pull_index].from) {
+                // we're pulling values out to the right, which means the end of a B subarray
+                index = pull[pull_index].from + 1;
+                for (count = 1; count < length; ++count) {
+                    index = FindLastForward(index, pull[pull_index].to, *index,
+                                            compare, length - count);
+                    Range<RandomAccessIterator> range(pull[pull_index].from, index - 1);
+                    std::rotate(range.start, range.start + count, range.end);
+                    pull[pull_index].from = index - count - 1;
+                }
+            }
+        }
+
+        // adjust block_size and buffer_size based on the values we were able to pull out
+        buffer_size = buffer1.length();
+        block_size = level.length() / buffer_size + 1;
+
+        // the first buffer NEEDS to be large enough to tag each of the evenly sized A blocks,
+        // so this was originally here to test the math for adjusting block_size above
+        //assert((level.length() + 1)/block_size <= buffer_size);
+
+        // now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort!
+        level.begin();
+        while (!level.finished()) {
+            Range<RandomAccessIterator> A = level.nextRange();
+            Range<RandomAccessIterator> B = level.nextRange();
+
+            // remove any parts of A or B that are being used by the internal buffers
+            RandomAccessIterator start = A.start;
+            if (start == pull[0].range.start) {
+                if (pull[0].from > pull[0].to) {
+                    A.start += pull[0].count;
+
+                    // if the internal buffer takes up the entire A or B subarray, then there's nothing to merge
+                    // this only happens for very small subarrays, like √4 = 2, 2 * (2 internal buffers) = 4,
+                    // which also only happens when cache_size is small or 0 since it'd otherwise use MergeExternal
+                    if (A.length() == 0) continue;
+                } else if (pull[0].from < pull[0].to) {
+                    B.end -= pull[0].count;
+                    if (B.length() == 0) continue;
+                }
+            }
+            if (start == pull[1].range.start) {
+                if (pull[1].from > pull[1].to) {
+                    A.start += pull[1].count;
+                    if (A.length() == 0) continue;
+                } else if (pull[1].from < pull[1].to) {
+                    B.end -= pull[1].count;
+                    if (B.length() == 0) continue;
+                }
+            }
+
+            if (compare(*(B.end - 1), *A.start)) {
+                // the two ranges are in reverse order, so a simple rotation should fix it
+                std::rotate(A.start, A.end, B.end);
+            } else if (compare(*A.end, *(A.end - 1))) {
+                // these two ranges weren't already in order, so we'll need to merge them!
+
+                // break the remainder of A into blocks. firstA is the uneven-sized first A block
+                Range<RandomAccessIterator> blockA(A);
+                Range<RandomAccessIterator> firstA(A.start, A.start + blockA.length() % block_size);
+
+                // swap the first value of each A block with the values in buffer1
+                for (RandomAccessIterator indexA = buffer1.start, index = firstA.end;
+                     index < blockA.end;
+                     ++indexA, index += block_size) {
+                    std::iter_swap(indexA, index);
+                }
+
+                // start rolling the A blocks through the B blocks!
+                // when we leave an A block behind we'll need to merge the previous A block with any B blocks that follow it, so track that information as well
+                Range<RandomAccessIterator> lastA (firstA);
+                Range<RandomAccessIterator> lastB (buffer1.start, buffer1.start);
+                Range<RandomAccessIterator> blockB (B.start, B.start + std::min(block_size, B.length()));
+                blockA.start += firstA.length();
+                RandomAccessIterator indexA = buffer1.start;
+
+                // if the first unevenly sized A block fits into the cache, copy it there for when we go to Merge it
+                // otherwise, if the second buffer is available, block swap the contents into that
+                if (lastA.length() <= cache_size) {
+                    std::move(lastA.start, lastA.end, cache);
+                } else if (buffer2.length() > 0) {
+                    std::swap_ranges(lastA.start, lastA.end, buffer2.start);
+                }
+
+                if (blockA.length() > 0) {
+                    while (true) {
+                        // if there's a previous B block and the first value of the minimum A block is <= the last value of the previous B block,
+                        // then drop that minimum A block behind. or if there are no B blocks left then keep dropping the remaining A blocks.
+                        if ((lastB.length() > 0 && !compare(*(lastB.end - 1), *indexA)) ||
+                            blockB.length() == 0) {
+                            // figure out where to split the previous B block, and rotate it at the split
+                            RandomAccessIterator B_split = LowerBound(lastB.start, lastB.end, *indexA, compare);
+                            std::size_t B_remaining = std::distance(B_split, lastB.end);
+
+                            // swap the minimum A block to the beginning of the rolling A blocks
+                            RandomAccessIterator minA = blockA.start;
+                            for (RandomAccessIterator findA = minA + block_size ; findA < blockA.end ; findA += block_size) {
+                                if (compare(*findA, *minA)) {
+                                    minA = findA;
+                                }
+                            }
+                            std::swap_ranges(blockA.start, blockA.start + block_size, minA);
+
+                            // swap the first item of the previous A block back with its original value, which is stored in buffer1
+                            std::iter_swap(blockA.start, indexA);
+                            ++indexA;
+
+                            // locally merge the previous A block with the B values that follow it
+                            // if lastA fits into the external cache we'll use that (with MergeExternal),
+                            // or if the second internal buffer exists we'll use that (with MergeInternal),
+                            // or failing that we'll use a strictly in-place merge algorithm (MergeInPlace)
+                            if (lastA.length() <= cache_size) {
+                                MergeExternal(lastA.start, lastA.end, lastA.end, B_split, cache, compare);
+                            } else if (buffer2.length() > 0) {
+                                MergeInternal(lastA.start, lastA.end, lastA.end, B_split, buffer2.start, compare);
+                            } else {
+                                MergeInPlace(lastA.start, lastA.end, lastA.end, B_split, compare);
+                            }
+
+                            if (buffer2.length() > 0 || block_size <= cache_size) {
+                                // copy the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway
+                                if (block_size <= cache_size) {
+                                    std::move(blockA.start, blockA.start + block_size, cache);
+                                } else {
+                                    std::swap_ranges(blockA.start, blockA.start + block_size, buffer2.start);
+                                }
+
+                                // this is equivalent to rotating, but faster
+                                // the area normally taken up by the A block is either the contents of buffer2, or data we don't need anymore since we memcopied it
+                                // either way we don't need to retain the order of those items, so instead of rotating we can just block swap B to where it belongs
+                                std::swap_ranges(B_split, B_split + B_remaining, blockA.start + block_size - B_remaining);
+                            } else {
+                                // we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation
+                                std::rotate(B_split, blockA.start, blockA.start + block_size);
+                            }
+
+                            // update the range for the remaining A blocks, and the range remaining from the B block after it was split
+                            lastA = Range<RandomAccessIterator>(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
+                            lastB = Range<RandomAccessIterator>(lastA.end, lastA.end + B_remaining);
+
+                            // if there are no more A blocks remaining, this step is finished!
+                            blockA.start += block_size;
+                            if (blockA.length() == 0) break;
+
+                        } else if (blockB.length() < block_size) {
+                            // move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation
+                            std::rotate(blockA.start, blockB.start, blockB.end);
+
+                            lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + blockB.length());
+                            blockA.start += blockB.length();
+                            blockA.end += blockB.length();
+                            blockB.end = blockB.start;
                         } else {
-                            // copy A3 and B3 into the array in the same order
-                            std::copy(A3.start, A3.end, A1.start);
-                            std::copy(B3.start, B3.end, A1.start + A1.length());
+                            // roll the leftmost A block to the end by swapping it with the next B block
+                            std::swap_ranges(blockA.start, blockA.start + block_size, blockB.start);
+                            lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + block_size);
+
+                            blockA.start += block_size;
+                            blockA.end += block_size;
+                            blockB.start += block_size;
+
+                            if (blockB.end > B.end - block_size) {
+                                blockB.end = B.end;
+                            } else {
+                                blockB.end += block_size;
+                            }
                         }
                     }
+                }
+
+                // merge the last A block with the remaining B values
+                if (lastA.length() <= cache_size) {
+                    MergeExternal(lastA.start, lastA.end, lastA.end, B.end, cache, compare);
+                } else if (buffer2.length() > 0) {
+                    MergeInternal(lastA.start, lastA.end, lastA.end, B.end, buffer2.start, compare);
+                } else {
+                    MergeInPlace(lastA.start, lastA.end, lastA.end, B.end, compare);
+                }
+            }
+        }
+
+        // when we're finished with this merge step we should have the one or two internal buffers left over, where the second buffer is all jumbled up
+        // insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer
+
+        // while an unstable sort like std::sort could be applied here, in benchmarks it was consistently slightly slower than a simple insertion sort,
+        // even for tens of millions of items. this may be because insertion sort is quite fast when the data is already somewhat sorted, like it is here
+        InsertionSort(buffer2.start, buffer2.end, compare);
+
+        for (pull_index = 0 ; pull_index < 2 ; ++pull_index) {
+            std::size_t unique = pull[pull_index].count * 2;
+            if (pull[pull_index].from > pull[pull_index].to) {
+                // the values were pulled out to the left, so redistribute them back to the right
+                Range<RandomAccessIterator> buffer(
+                    pull[pull_index].range.start,
+                    pull[pull_index].range.start + pull[pull_index].count
+                );
+                while (buffer.length() > 0) {
+                    index = FindFirstForward(buffer.end, pull[pull_index].range.end,
+                                             *buffer.start, compare, unique);
+                    std::size_t amount = index - buffer.end;
+                    std::rotate(buffer.start, buffer.end, index);
+                    buffer.start += (amount + 1);
+                    buffer.end += amount;
+                    unique -= 2;
+                }
+            } else if (pull[pull_index].from < pull[pull_index].to) {
+                // the values were pulled out to the right, so redistribute them back to the left
+                Range<RandomAccessIterator> buffer(
+                    pull[pull_index].range.end - pull[pull_index].count,
+                    pull[pull_index].range.end
+                );
+                while (buffer.length() > 0) {
+                    index = FindLastBackward(pull[pull_index].range.start, buffer.start,
+                                             *(buffer.end - 1), compare, unique);
+                    std::size_t amount = buffer.start - index;
+                    std::rotate(index, index + amount, buffer.end);
+                    buffer.start -= amount;
+                    buffer.end -= (amount + 1);
+                    unique -= 2;
+                }
+            }
+        }
+    }
+
+    // merge two adjacent sorted ranges in whichever way is cheapest: not at all if they're already in order,
+    // with a rotation if they're in reverse order, MergeExternal if A or B fits into the cache,
+    // SymMerge if one of them is much shorter than the other, or block merging if not
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    void MergePair(Range<RandomAccessIterator> A, Range<RandomAccessIterator> B,
+                   T *cache, const std::size_t cache_size, Comparison compare) {
+        if (A.length() == 0 || B.length() == 0) return;
+
+        if (compare(*(B.end - 1), *A.start)) {
+            std::rotate(A.start, A.end, B.end);
+        } else if (compare(*B.start, *(A.end - 1))) {
+            // the items at the start of A and the end of B are already in their final positions,
+            // which for nearly sorted runs is almost all of them
+            A.start = UpperBound(A.start, A.end, *B.start, compare);
+            B.end = LowerBound(B.start, B.end, *(A.end - 1), compare);
+
+            std::size_t shorter = std::min(A.length(), B.length());
+            if (A.length() <= cache_size) {
+                std::move(A.start, A.end, cache);
+                MergeExternal(A.start, A.end, B.start, B.end, cache, compare);
+            } else if (B.length() <= cache_size) {
+                std::move(B.start, B.end, cache);
+                MergeExternalBackward(A.start, A.end, B.start, B.end, cache, compare);
+            } else if (shorter * shorter <= A.length() + B.length()) {
+                // the block merge is built for subarrays of similar lengths, and with √A blocks
+                // it makes a few passes over the longer side no matter how few items are in the shorter one
+                SymMerge(A.start, A.end, B.end, compare);
+            } else {
+                MergeLevelInPlace(Pair<RandomAccessIterator>(A, B), cache, cache_size, compare);
+            }
+        }
+    }
+
+    // find how many items from A are within the first 'rank' items of the stable merge of A and B
+    // this is the "merge path" – splitting the merge at a few ranks gives pieces that can be merged independently
+    template <typename RandomAccessIterator, typename Comparison>
+    std::size_t CoRank(Range<RandomAccessIterator> A, Range<RandomAccessIterator> B, std::size_t rank, Comparison compare) {
+        std::size_t low = (rank > B.length()) ? rank - B.length() : 0;
+        std::size_t high = std::min(rank, A.length());
+
+        // find the first item in A that comes after the B item it would otherwise be swapped with
+        while (low < high) {
+            std::size_t mid = low + (high - low)/2;
+            if (compare(B.start[rank - mid - 1], A.start[mid])) high = mid;
+            else low = mid + 1;
+        }
+        return low;
+    }
+
+    // bottom-up merge sort combined with an in-place merge algorithm, using the buffer as the cache
+    template <typename RandomAccessIterator, typename Comparison>
+    void LevelSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+                   typename std::iterator_traits<RandomAccessIterator>::value_type *buffer, std::size_t buffer_len) {
+        const std::size_t size = std::distance(first, last);
+
+        // if the array is of size 0, 1, 2, or 3, just sort them like so:
+        if (size < 4) {
+            if (size == 3) {
+                // hard-coded insertion sort
+                if (compare(first[1], first[0])) {
+                    std::iter_swap(first + 0, first + 1);
+                }
+                if (compare(first[2], first[1])) {
+                    std::iter_swap(first + 1, first + 2);
+                    if (compare(first[1], first[0])) {
+                        std::iter_swap(first + 0, first + 1);
+                    }
+                }
+            } else if (size == 2) {
+                // swap the items if they're out of order
+                if (compare(first[1], first[0])) {
+                    std::iter_swap(first + 0, first + 1);
+                }
+            }
+
+            return;
+        }
+
+        // sort groups of 4-8 items at a time using an unstable sorting network,
+        // but keep track of the original item orders to force it to be stable
+        Wiki::Iterator iterator (size, 4);
+        NetworkSortLevel(Level<RandomAccessIterator>(iterator, first), compare);
+        if (size < 8) return;
+
+        // use the buffer to speed up some of the operations
+        // (there's no point in using more than half of the array, since A is never larger than that)
+        typename std::iterator_traits<RandomAccessIterator>::value_type *cache = buffer;
+        const std::size_t cache_size = std::min(buffer_len, (size + 1)/2);
+
+        // then merge sort the higher levels, which can be 8-15, 16-31, 32-63, 64-127, etc.
+        while (true) {
+            // if every A and B block will fit into the cache, use a special branch specifically for merging with the cache
+            // (we use < rather than <= since the block size might be one more than iterator.length())
+            if (iterator.length() < cache_size) {
+
+                // if four subarrays fit into the cache, it's faster to merge both pairs of subarrays into the cache,
+                // then merge the two merged subarrays from the cache back into the original array
+                if ((iterator.length() + 1) * 4 <= cache_size && iterator.length() * 4 <= size) {
+                    MergeLevelsWithCache(Level<RandomAccessIterator>(iterator, first), cache, compare);
+
+                    // we merged two levels at the same time, so we're done with this level already
+                    // (iterator.nextLevel() is called again at the bottom of this outer merge loop)
+                    iterator.nextLevel();
+
+                } else {
+                    MergeLevelWithCache(Level<RandomAccessIterator>(iterator, first), cache, compare);
+                }
+            } else {
+                MergeLevelInPlace(Level<RandomAccessIterator>(iterator, first), cache, cache_size, compare);
+            }
+
+            // double the size of each A and B subarray that will be merged in the next level
+            if (!iterator.nextLevel()) break;
+        }
+    }
+
+    // find the end of the run starting at first, which is either non-descending or strictly descending
+    // descending runs are reversed in place, which is still stable since none of their items are equal
+    template <typename RandomAccessIterator, typename Comparison>
+    RandomAccessIterator FindRun(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        RandomAccessIterator end = first + 1;
+        if (end == last) return end;
+
+        if (compare(*end, *first)) {
+            while (++end != last && compare(*end, *(end - 1))) {}
+            std::reverse(first, end);
+        } else {
+            while (++end != last && !compare(*end, *(end - 1))) {}
+        }
+        return end;
+    }
+
+    // merge the runs at index and index + 1 on the stack of runs
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    void MergeRuns(Range<RandomAccessIterator> *runs, std::size_t & count, std::size_t index,
+                   T *cache, const std::size_t cache_size, Comparison compare) {
+        MergePair(runs[index], runs[index + 1], cache, cache_size, compare);
+        runs[index].end = runs[index + 1].end;
+        std::copy(runs + index + 2, runs + count, runs + index + 1);
+        count--;
+    }
+
+    // merge the runs at the top of the stack until their lengths shrink quickly enough going up the stack, as in TimSort
+    // (including the extra check on the fourth run from the top, without which the invariant can be broken)
+    // this keeps the merges balanced, and the stack stays shorter than the logarithm of the size
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    void CollapseRuns(Range<RandomAccessIterator> *runs, std::size_t & count,
+                      T *cache, const std::size_t cache_size, Comparison compare) {
+        while (count > 1) {
+            std::size_t index = count - 2;
+            if ((index > 0 && runs[index - 1].length() <= runs[index].length() + runs[index + 1].length()) ||
+                (index > 1 && runs[index - 2].length() <= runs[index - 1].length() + runs[index].length())) {
+                if (runs[index - 1].length() < runs[index + 1].length()) index--;
+            } else if (runs[index].length() > runs[index + 1].length()) {
+                break;
+            }
+            MergeRuns(runs, count, index, cache, cache_size, compare);
+        }
+    }
+
+    // adaptive front end for the bottom-up merge sort: find the runs that are already in order,
+    // sort any stretch of short runs between them with the usual levels, then merge the runs
+    // this makes nearly sorted arrays close to O(n), while unordered parts of the array skip looking for runs more and more
+    template <typename RandomAccessIterator, typename Comparison>
+    void NaturalSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+                     typename std::iterator_traits<RandomAccessIterator>::value_type *cache, std::size_t cache_size) {
+        // runs shorter than this aren't worth merging separately
+        const std::ptrdiff_t min_run = 64;
+
+        // if this many items in a row only hold short runs, they're mostly unordered, so add the next 'skip' items
+        // to the stretch without looking for runs in them, then look again. 'skip' doubles each time,
+        // so unordered arrays hardly pay for looking for runs and still get sorted as one stretch,
+        // but the stretch ends at the next long run, so ordered parts later in the array are still found
+        // (for n unordered items, only about max_stretch * log2(n/max_stretch) of them are checked for runs)
+        const std::ptrdiff_t max_stretch = 256;
+
+        if (last - first < max_stretch) {
+            LevelSort(first, last, compare, cache, cache_size);
+            return;
+        }
+
+        // the run lengths at least double every two runs down the stack, so this is enough for any size
+        Range<RandomAccessIterator> runs[128];
+        std::size_t count = 0;
+
+        RandomAccessIterator start = first;
+        while (start != last) {
+            RandomAccessIterator end = FindRun(start, last, compare), next = end;
+
+            if (end - start < min_run) {
+                std::ptrdiff_t skip = max_stretch;
+                while (true) {
+                    RandomAccessIterator scan = end;
+                    while (end != last && end - scan < max_stretch) {
+                        next = FindRun(end, last, compare);
+                        if (next - end >= min_run) break;
+                        end = next;
+                    }
+
+                    // stop at the long run or the end of the array, otherwise skip ahead
+                    if (next != end || end == last) break;
+                    end = next = end + std::min(skip, (std::ptrdiff_t)(last - end));
+                    skip *= 2;
+                }
+                LevelSort(start, end, compare, cache, cache_size);
+            }
+
+            runs[count++] = Range<RandomAccessIterator>(start, end);
+            CollapseRuns(runs, count, cache, cache_size, compare);
+
+            // the run that ended the stretch of short runs
+            if (next != end) {
+                runs[count++] = Range<RandomAccessIterator>(end, next);
+                CollapseRuns(runs, count, cache, cache_size, compare);
+            }
+            start = next;
+        }
+
+        // then merge whatever is left, smallest first
+        while (count > 1) {
+            std::size_t index = count - 2;
+            if (index > 0 && runs[index - 1].length() < runs[index + 1].length()) index--;
+            MergeRuns(runs, count, index, cache, cache_size, compare);
+        }
+    }
+
+    // natural merge sort with a block merge, using the caller's buffer as the cache
+    // any buffer_len works, from 0 (fully in-place) up to (size + 1)/2 (every merge goes through the buffer),
+    // and the buffer's contents are overwritten, so it can be reused between calls without allocating
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+              typename std::iterator_traits<RandomAccessIterator>::value_type *buffer, std::size_t buffer_len) {
+        NaturalSort(first, last, compare, buffer, buffer_len);
+    }
+
+    // bottom-up merge sort combined with an in-place merge algorithm, with a cache sized by the given policy
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, CachePolicy policy) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t size = std::distance(first, last);
+
+        // the cache isn't used below 8 items, so don't bother constructing one
+        if (size < 8) {
+            Sort(first, last, compare, (T *)NULL, 0);
+            return;
+        }
+
+        if (policy.mode == CachePolicy::Fixed) {
+            Sort(first, last, compare, StackCache<WIKISORT_CACHE_BYTES>());
+        } else {
+            Cache<T> memory (size, policy);
+            CacheItems<T> cache (memory.memory, memory.cache_size, first);
+            Sort(first, last, compare, cache.data(), cache.size());
+        }
+    }
+
+    // bottom-up merge sort combined with an in-place merge algorithm, with a fixed-size cache on the stack
+    template <typename RandomAccessIterator, typename Comparison, std::size_t bytes>
+    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, StackCache<bytes>) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        const std::size_t size = std::distance(first, last);
+
+        // the cache isn't used below 8 items, so don't bother constructing one
+        if (size < 8) {
+            Sort(first, last, compare, (T *)NULL, 0);
+            return;
+        }
+
+        // since the cache size is fixed, it's still O(1) memory!
+        // just keep in mind that making it too small ruins the point (nothing will fit into it),
+        // and making it too large also ruins the point (so much for "low memory"!)
+        // removing the cache entirely still gives 75% of the performance of a standard merge
+        const std::size_t cache_size = StackCache<bytes>::template Items<T>::value;
+        StackArray<T, cache_size> memory;
+        CacheItems<T> cache (memory.data(), std::min(cache_size, (size + 1)/2), first);
+        Sort(first, last, compare, cache.data(), cache.size());
+    }
+
+    // bottom-up merge sort combined with an in-place merge algorithm for O(1) memory use
+    template <typename RandomAccessIterator, typename Comparison>
+    void Sort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        Sort(first, last, compare, CachePolicy());
+    }
+
+    // stable merge of the adjacent sorted ranges [first, middle) and [middle, last), using the caller's buffer as the cache
+    // like Sort, any buffer_len works, from 0 (fully in-place) up to the length of the shorter range
+    template <typename RandomAccessIterator, typename Comparison>
+    void Merge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare,
+               typename std::iterator_traits<RandomAccessIterator>::value_type *buffer, std::size_t buffer_len) {
+        MergePair(Range<RandomAccessIterator>(first, middle), Range<RandomAccessIterator>(middle, last),
+                  buffer, buffer_len, compare);
+    }
+
+    // drop-in replacement for std::inplace_merge, but with O(1) memory (a fixed-size cache on the stack)
+    template <typename RandomAccessIterator, typename Comparison>
+    void InplaceMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        // don't bother constructing the cache if the ranges are already in order
+        if (first == middle || middle == last || !compare(*middle, *(middle - 1))) return;
+
+        // there's no point in a cache larger than the shorter range, since that's the most that will ever go into it
+        const std::size_t cache_size = StackCache<WIKISORT_CACHE_BYTES>::template Items<T>::value;
+        const std::size_t shorter = std::min(std::distance(first, middle), std::distance(middle, last));
+        StackArray<T, cache_size> memory;
+        CacheItems<T> cache (memory.data(), std::min(cache_size, shorter), first);
+        Merge(first, middle, last, compare, cache.data(), cache.size());
+    }
+
+    template <typename RandomAccessIterator>
+    void InplaceMerge(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        InplaceMerge(first, middle, last, std::less<T>());
+    }
+
+    // sort the items appended to an already sorted prefix [first, sorted_end), then merge them into it
+    // for k new items this costs O(k log k) plus one merge, rather than sorting the whole array again,
+    // and it uses O(1) memory, the same fixed-size cache on the stack as Sort
+    template <typename RandomAccessIterator, typename Comparison>
+    void SortAppended(RandomAccessIterator first, RandomAccessIterator sorted_end, RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        if (sorted_end == last) return;
+
+        // the new items are the shorter range in the merge as long as there are fewer of them than in the prefix,
+        // and they're also the most that would go into the cache while sorting them, so that's all the cache needs to hold
+        const std::size_t cache_size = StackCache<WIKISORT_CACHE_BYTES>::template Items<T>::value;
+        StackArray<T, cache_size> memory;
+        CacheItems<T> cache (memory.data(), std::min(cache_size, (std::size_t)std::distance(sorted_end, last)), sorted_end);
+
+        Sort(sorted_end, last, compare, cache.data(), cache.size());
+        Merge(first, sorted_end, last, compare, cache.data(), cache.size());
+    }
+
+    // stable partial sort: afterward [first, middle) holds the items a stable sort would put there, in the same order,
+    // and the rest of the items are in [middle, last) in no particular order
+    // the remaining items are compared against the last of the kept items in a single pass, and the ones that come before it
+    // are gathered up after middle, then sorted and merged into the kept items whenever there are enough of them.
+    // that's O(n log k) comparisons in the worst case but closer to O(n) for most inputs, with O(1) memory
+    template <typename RandomAccessIterator, typename Comparison>
+    void PartialSort(RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        if (first == middle) return;
+
+        // when only a few items are kept, gather more than that at a time so the sorts and merges don't add up
+        const std::ptrdiff_t kept = std::distance(first, middle);
+        const std::ptrdiff_t batch = std::max(kept, (std::ptrdiff_t)256);
+
+        // each merge goes through the cache if the kept items fit into it, so it doesn't need to be any longer than that
+        const std::size_t cache_size = StackCache<WIKISORT_CACHE_BYTES>::template Items<T>::value;
+        StackArray<T, cache_size> memory;
+        CacheItems<T> cache (memory.data(), std::min(cache_size, (std::size_t)kept), first);
+
+        Sort(first, middle, compare, cache.data(), cache.size());
+
+        // every item before 'gathered' came from later in the array than the kept items,
+        // so it only belongs among them if it's strictly less than the last one
+        RandomAccessIterator gathered = middle;
+        for (RandomAccessIterator index = middle; index != last; ++index) {
+            if (!compare(*index, *(middle - 1))) continue;
+
+            std::iter_swap(gathered, index);
+            if (++gathered - middle == batch) {
+                Sort(middle, gathered, compare, cache.data(), cache.size());
+                Merge(first, middle, gathered, compare, cache.data(), cache.size());
+                gathered = middle;
+            }
+        }
+
+        if (gathered != middle) {
+            Sort(middle, gathered, compare, cache.data(), cache.size());
+            Merge(first, middle, gathered, compare, cache.data(), cache.size());
+        }
+    }
+
+    // stable nth_element: afterward nth holds the item a stable sort would put there, the items before it are the ones
+    // that come before it in that order (and are sorted, since finding nth sorts them anyway), and the rest come after it
+    template <typename RandomAccessIterator, typename Comparison>
+    void NthElement(RandomAccessIterator first, RandomAccessIterator nth, RandomAccessIterator last, Comparison compare) {
+        if (nth == last) return;
+        PartialSort(first, nth + 1, last, compare);
+    }
+
+    // stable partition of a range that fits into the cache: the items that satisfy pred are moved forward in place,
+    // and the rest are moved into the cache, then back again after them
+    template <typename RandomAccessIterator, typename T, typename Predicate>
+    RandomAccessIterator PartitionWithCache(RandomAccessIterator first, RandomAccessIterator last, Predicate pred, T *cache) {
+        // the items at the start that satisfy pred are already where they belong
+        while (first != last && pred(*first)) ++first;
+        if (first == last) return last;
+
+        // and the first one that doesn't goes straight into the cache
+        RandomAccessIterator insert = first;
+        T *cache_end = cache;
+        *cache_end++ = std::move(*first);
+
+        for (++first; first != last; ++first) {
+            if (pred(*first)) *insert++ = std::move(*first);
+            else *cache_end++ = std::move(*first);
+        }
+
+        std::move(cache, cache_end, insert);
+        return insert;
+    }
+
+    // stable partition without a buffer: partition each half, then rotate the second half's true items
+    // in front of the first half's false items. that's O(n log n) moves, but only for ranges larger than the cache,
+    // since those are partitioned directly, and pred is still only called once for each item
+    template <typename RandomAccessIterator, typename T, typename Predicate>
+    RandomAccessIterator PartitionInPlace(RandomAccessIterator first, RandomAccessIterator last, Predicate pred,
+                                          T *cache, const std::size_t cache_size) {
+        const std::size_t size = std::distance(first, last);
+        if (size <= cache_size) return PartitionWithCache(first, last, pred, cache);
+        if (size == 1) return pred(*first) ? last : first;
+
+        RandomAccessIterator middle = first + size/2;
+        RandomAccessIterator left = PartitionInPlace(first, middle, pred, cache, cache_size);
+        RandomAccessIterator right = PartitionInPlace(middle, last, pred, cache, cache_size);
+        std::rotate(left, middle, right);
+        return left + (right - middle);
+    }
+
+    // like std::stable_partition, but using the caller's buffer instead of allocating one
+    // any buffer_len works, from 0 (fully in-place) up to the size of the range (a single linear pass)
+    template <typename RandomAccessIterator, typename Predicate>
+    RandomAccessIterator StablePartition(RandomAccessIterator first, RandomAccessIterator last, Predicate pred,
+                                         typename std::iterator_traits<RandomAccessIterator>::value_type *buffer,
+                                         std::size_t buffer_len) {
+        return PartitionInPlace(first, last, pred, buffer, buffer_len);
+    }
+
+    // like std::stable_partition, but with O(1) memory (a fixed-size cache on the stack)
+    template <typename RandomAccessIterator, typename Predicate>
+    RandomAccessIterator StablePartition(RandomAccessIterator first, RandomAccessIterator last, Predicate pred) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        const std::size_t cache_size = StackCache<WIKISORT_CACHE_BYTES>::template Items<T>::value;
+        StackArray<T, cache_size> memory;
+        CacheItems<T> cache (memory.data(), std::min(cache_size, (std::size_t)std::distance(first, last)), first);
+        return StablePartition(first, last, pred, cache.data(), cache.size());
+    }
+
+    // find the end of the run of items equal to *first in a sorted range
+    // most runs are short, so check the next item before galloping, but long runs still only take O(log length) comparisons
+    template <typename RandomAccessIterator, typename Comparison>
+    RandomAccessIterator FindGroupEnd(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        RandomAccessIterator next = first + 1;
+        if (next == last || compare(*first, *next)) return next;
+        return FindLastGallop(next + 1, last, *first, compare);
+    }
+
+    // keep only the first of each run of equal items in a sorted range, like std::unique
+    template <typename RandomAccessIterator, typename Comparison>
+    RandomAccessIterator UniqueSorted(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        RandomAccessIterator insert = first;
+        for (RandomAccessIterator start = first; start != last; ++insert) {
+            RandomAccessIterator end = FindGroupEnd(start, last, compare);
+            if (insert != start) *insert = std::move(*start);
+            start = end;
+        }
+        return insert;
+    }
+
+    // write a Range for each run of equal items in a sorted range to 'groups', in order
+    template <typename RandomAccessIterator, typename Comparison, typename OutputIterator>
+    OutputIterator GroupsSorted(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, OutputIterator groups) {
+        for (RandomAccessIterator start = first; start != last; ++groups) {
+            RandomAccessIterator end = FindGroupEnd(start, last, compare);
+            *groups = Range<RandomAccessIterator>(start, end);
+            start = end;
+        }
+        return groups;
+    }
+
+    // stable sort, then keep only the first of each run of equal items, which is the one that came first originally
+    // like std::unique this returns the new end of the range, and the items after it are left in a valid but unspecified state
+    // the groups are found in a separate pass after sorting, which gallops through long runs of equal items
+    template <typename RandomAccessIterator, typename Comparison>
+    RandomAccessIterator SortUnique(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        Sort(first, last, compare);
+        return UniqueSorted(first, last, compare);
+    }
+
+    // SortUnique with the caller's buffer as the cache, like Sort
+    template <typename RandomAccessIterator, typename Comparison>
+    RandomAccessIterator SortUnique(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+                                    typename std::iterator_traits<RandomAccessIterator>::value_type *buffer, std::size_t buffer_len) {
+        Sort(first, last, compare, buffer, buffer_len);
+        return UniqueSorted(first, last, compare);
+    }
+
+    // SortUnique with a cache sized by the given policy, like Sort
+    template <typename RandomAccessIterator, typename Comparison>
+    RandomAccessIterator SortUnique(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, CachePolicy policy) {
+        Sort(first, last, compare, policy);
+        return UniqueSorted(first, last, compare);
+    }
+
+    // stable sort, then write a Range for each run of equal items to 'groups', in order, and return the end of the output
+    // (the groups are found in a separate pass after sorting, like SortUnique)
+    template <typename RandomAccessIterator, typename Comparison, typename OutputIterator>
+    OutputIterator SortGroups(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, OutputIterator groups) {
+        Sort(first, last, compare);
+        return GroupsSorted(first, last, compare, groups);
+    }
+
+    // SortGroups with the caller's buffer as the cache, like Sort
+    template <typename RandomAccessIterator, typename Comparison, typename OutputIterator>
+    OutputIterator SortGroups(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, OutputIterator groups,
+                              typename std::iterator_traits<RandomAccessIterator>::value_type *buffer, std::size_t buffer_len) {
+        Sort(first, last, compare, buffer, buffer_len);
+        return GroupsSorted(first, last, compare, groups);
+    }
+
+    // SortGroups with a cache sized by the given policy, like Sort
+    template <typename RandomAccessIterator, typename Comparison, typename OutputIterator>
+    OutputIterator SortGroups(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, OutputIterator groups,
+                              CachePolicy policy) {
+        Sort(first, last, compare, policy);
+        return GroupsSorted(first, last, compare, groups);
+    }
+
+    // a record's key paired with the record's original position, for SortIndirect
+    template <typename Key>
+    struct KeyIndex {
+        Key key;
+        std::size_t index;
+    };
+
+    // a record's key paired with the record itself, for SortBy
+    template <typename Key, typename T>
+    struct KeyItem {
+        Key key;
+        T item;
+    };
+
+    // compare KeyIndex or KeyItem pairs by their keys
+    template <typename Comparison>
+    struct CompareKeys {
+        Comparison compare;
+
+        CompareKeys(Comparison compare):
+            compare(compare)
+        {}
+
+        template <typename Pair>
+        bool operator()(const Pair & a, const Pair & b) const {
+            return compare(a.key, b.key);
+        }
+    };
+
+    // compare items by projecting each one to its key first
+    template <typename Projection, typename Comparison>
+    struct CompareProjected {
+        Projection projection;
+        Comparison compare;
+
+        CompareProjected(Projection projection, Comparison compare):
+            projection(projection),
+            compare(compare)
+        {}
+
+        template <typename T>
+        bool operator()(const T & a, const T & b) const {
+            return compare(projection(a), projection(b));
+        }
+    };
+
+    // sort large records by sorting compact (key, original position) pairs instead, then moving each record
+    // straight to its final position by following the cycles of the permutation, so every record moves about once.
+    // this needs memory for the pairs (and falls back to sorting the records directly if that can't be allocated),
+    // but otherwise only ever holds one extra record at a time
+    template <typename RandomAccessIterator, typename KeyFunction, typename Comparison>
+    void SortIndirect(RandomAccessIterator first, RandomAccessIterator last, KeyFunction key, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        typedef typename std::decay<decltype(key(*first))>::type Key;
+        const std::size_t size = std::distance(first, last);
+
+        std::vector<KeyIndex<Key> > pairs;
+        try {
+            pairs.reserve(size);
+        } catch (const std::bad_alloc &) {
+            Sort(first, last, CompareProjected<KeyFunction, Comparison>(key, compare));
+            return;
+        }
+
+        for (std::size_t index = 0; index < size; ++index) {
+            KeyIndex<Key> pair = { key(first[index]), index };
+            pairs.push_back(pair);
+        }
+        Sort(pairs.begin(), pairs.end(), CompareKeys<Comparison>(compare));
+
+        // pairs[index].index is where the record that belongs at index is now, so walk each cycle of that permutation,
+        // pulling each record into place from where it is now, and marking each position as done once it's filled
+        for (std::size_t start = 0; start < size; ++start) {
+            if (pairs[start].index == start) continue;
+
+            T item = std::move(first[start]);
+            std::size_t index = start;
+            while (pairs[index].index != start) {
+                std::size_t from = pairs[index].index;
+                first[index] = std::move(first[from]);
+                pairs[index].index = index;
+                index = from;
+            }
+            first[index] = std::move(item);
+            pairs[index].index = index;
+        }
+    }
+
+    template <typename RandomAccessIterator, typename KeyFunction>
+    void SortIndirect(RandomAccessIterator first, RandomAccessIterator last, KeyFunction key) {
+        typedef typename std::decay<decltype(key(*first))>::type Key;
+        SortIndirect(first, last, key, std::less<Key>());
+    }
+
+    // whether SortBy computes each item's key once up front, or again for every comparison
+    enum KeyCaching {
+        CacheKeys,
+        RecomputeKeys
+    };
+
+    // sort by the key that 'projection' returns for each item, compared with 'compare', like the C++20 ranges algorithms.
+    // with CacheKeys, every key is computed exactly once and the sort only ever compares the precomputed keys:
+    // small items are sorted right alongside their keys, while items larger than a cache line use SortIndirect
+    // (if there isn't enough memory for the keys, it falls back to recomputing them)
+    template <typename RandomAccessIterator, typename Projection, typename Comparison>
+    void SortBy(RandomAccessIterator first, RandomAccessIterator last, Projection projection, Comparison compare,
+                KeyCaching caching = CacheKeys) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        typedef typename std::decay<decltype(projection(*first))>::type Key;
+        const std::size_t size = std::distance(first, last);
+
+        if (caching == RecomputeKeys || size < 2) {
+            Sort(first, last, CompareProjected<Projection, Comparison>(projection, compare));
+            return;
+        }
+
+        if (sizeof(T) > 64) {
+            SortIndirect(first, last, projection, compare);
+            return;
+        }
+
+        std::vector<KeyItem<Key, T> > pairs;
+        try {
+            pairs.reserve(size);
+        } catch (const std::bad_alloc &) {
+            Sort(first, last, CompareProjected<Projection, Comparison>(projection, compare));
+            return;
+        }
+
+        for (RandomAccessIterator index = first; index != last; ++index) {
+            KeyItem<Key, T> pair = { projection(*index), std::move(*index) };
+            pairs.push_back(std::move(pair));
+        }
+        Sort(pairs.begin(), pairs.end(), CompareKeys<Comparison>(compare));
+        for (std::size_t index = 0; index < size; ++index) {
+            first[index] = std::move(pairs[index].item);
+        }
+    }
+
+    template <typename RandomAccessIterator, typename Projection>
+    void SortBy(RandomAccessIterator first, RandomAccessIterator last, Projection projection) {
+        typedef typename std::decay<decltype(projection(*first))>::type Key;
+        SortBy(first, last, projection, std::less<Key>());
+    }
+
+    // std::barrier is only available from C++20, so here's a simple reusable one for ParallelSort
+    class Barrier {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::size_t threads, waiting, generation;
+        bool cancelled;
+
+    public:
+
+        Barrier(std::size_t threads):
+            threads(threads),
+            waiting(0),
+            generation(0),
+            cancelled(false)
+        {}
+
+        // block until every thread has called wait() for this generation
+        // returns false if the barrier was cancelled instead, in which case the other threads may never arrive
+        bool wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (cancelled) return false;
+
+            std::size_t current = generation;
+            if (++waiting == threads) {
+                waiting = 0;
+                ++generation;
+                condition.notify_all();
+                return true;
+            }
+            while (generation == current && !cancelled) condition.wait(lock);
+            return (generation != current);
+        }
+
+        // release every thread waiting on the barrier, and make every later wait() return false right away
+        void cancel() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cancelled = true;
+            condition.notify_all();
+        }
+    };
+
+    // the share of a level's ranges that the given thread is responsible for,
+    // in whole groups of 'unit' ranges so no A and B pair is split between threads
+    template <typename RandomAccessIterator>
+    Level<RandomAccessIterator> Slice(const Wiki::Iterator & iterator, RandomAccessIterator first,
+                                      std::size_t unit, std::size_t thread, std::size_t threads) {
+        std::size_t units = iterator.ranges() / unit;
+        return Level<RandomAccessIterator>(iterator, first,
+                                           units * thread / threads * unit,
+                                           units * (thread + 1) / threads * unit);
+    }
+
+    // reverse a range of items, where this thread only swaps its own share of them
+    template <typename RandomAccessIterator>
+    void ReverseSlice(RandomAccessIterator first, RandomAccessIterator last, std::size_t thread, std::size_t threads) {
+        std::size_t half = std::distance(first, last)/2;
+        std::size_t from = half * thread / threads, to = half * (thread + 1) / threads;
+        std::swap_ranges(first + from, first + to, std::reverse_iterator<RandomAccessIterator>(last - from));
+    }
+
+    // merge A and B with the help of 'threads' threads, where this is thread number 'thread'
+    // the merge is split into one piece per thread along the merge path, then the pieces are moved next to each other
+    // with rotations (performed by reversals that every thread in the group takes part in), and finally each thread
+    // merges its own piece with MergePair. every thread in the ParallelSort needs to call this, even if it has nothing to merge
+    template <typename RandomAccessIterator, typename T, typename Comparison>
+    void ParallelMerge(Range<RandomAccessIterator> A, Range<RandomAccessIterator> B, T *cache, const std::size_t cache_size,
+                       Comparison compare, std::size_t thread, std::size_t threads, Barrier & barrier) {
+        // split points in A and B for each piece, which all need to be found before anything gets moved
+        std::vector<std::size_t> split_A (threads + 1), split_B (threads + 1);
+        for (std::size_t piece = 0; piece <= threads; ++piece) {
+            std::size_t rank = (A.length() + B.length()) * piece / threads;
+            split_A[piece] = CoRank(A, B, rank, compare);
+            split_B[piece] = rank - split_A[piece];
+        }
+        barrier.wait();
+
+        // pieces [low, high) start out as their A parts followed by their B parts, so move the B parts for [low, mid)
+        // before the A parts for [mid, high), then handle each half the same way until every piece is on its own
+        std::size_t low = 0, high = threads;
+        for (std::size_t span = threads; span > 1; span = (span + 1)/2) {
+            std::size_t mid = low + (high - low)/2;
+            RandomAccessIterator start = A.start + split_A[low] + split_B[low];
+            RandomAccessIterator rotate_start = start + (split_A[mid] - split_A[low]);
+            RandomAccessIterator rotate_mid = start + (split_A[high] - split_A[low]);
+            RandomAccessIterator rotate_end = rotate_mid + (split_B[mid] - split_B[low]);
+
+            if (high - low > 1) {
+                ReverseSlice(rotate_start, rotate_mid, thread - low, high - low);
+                ReverseSlice(rotate_mid, rotate_end, thread - low, high - low);
+            }
+            barrier.wait();
+            if (high - low > 1) {
+                ReverseSlice(rotate_start, rotate_end, thread - low, high - low);
+                if (thread < mid) high = mid;
+                else low = mid;
+            }
+            barrier.wait();
+        }
 
-                    // we merged two levels at the same time, so we're done with this level already
-                    // (iterator.nextLevel() is called again at the bottom of this outer merge loop)
-                    iterator.nextLevel();
+        RandomAccessIterator start = A.start + split_A[thread] + split_B[thread];
+        Range<RandomAccessIterator> pieceA (start, start + (split_A[thread + 1] - split_A[thread]));
+        Range<RandomAccessIterator> pieceB (pieceA.end, pieceA.end + (split_B[thread + 1] - split_B[thread]));
+        MergePair(pieceA, pieceB, cache, cache_size, compare);
+    }
+
+    // one of the threads started by ParallelSort
+    // every thread walks through the same levels of the merge sort as Sort() does,
+    // but only merges its own slice of each level, then waits for the others before moving on to the next one
+    template <typename RandomAccessIterator, typename Comparison>
+    void ParallelWorker(RandomAccessIterator first, RandomAccessIterator last, Comparison compare,
+                        std::size_t thread, std::size_t threads, Barrier & barrier) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t size = std::distance(first, last);
+
+        // the work is split between all of the threads, so wait until they've all started
+        // (if ParallelSort couldn't start them all, it cancels the barrier and sorts the array by itself instead)
+        if (!barrier.wait()) return;
 
+        Wiki::Iterator iterator (size, 4);
+        NetworkSortLevel(Slice(iterator, first, 1, thread, threads), compare);
+        barrier.wait();
+
+        // each thread gets its own fixed-size cache, so the memory use is still O(1) per thread
+        // (the cache items are constructed from a separate part of the array for each thread,
+        // and every thread needs to be done with that before any of them start merging)
+        const std::size_t cache_limit = StackCache<WIKISORT_CACHE_BYTES>::Items<T>::value;
+        StackArray<T, cache_limit> memory;
+        CacheItems<T> cache_items (memory.data(), std::min(cache_limit, size/threads), first + thread * (size/threads));
+        T *cache = cache_items.data();
+        const std::size_t cache_size = cache_items.size();
+        if (!std::is_trivial<T>::value) barrier.wait();
+
+        while (true) {
+            if (iterator.length() < cache_size) {
+                if ((iterator.length() + 1) * 4 <= cache_size && iterator.length() * 4 <= size) {
+                    MergeLevelsWithCache(Slice(iterator, first, 4, thread, threads), cache, compare);
+                    iterator.nextLevel();
                 } else {
-                    iterator.begin();
-                    while (!iterator.finished()) {
-                        Range<RandomAccessIterator> A = iterator.nextRange(first);
-                        Range<RandomAccessIterator> B = iterator.nextRange(first);
-
-                        if (compare(*(B.end - 1), *A.start)) {
-                            // the two ranges are in reverse order, so a simple rotation should fix it
-                            std::rotate(A.start, A.end, B.end);
-                        } else if (compare(*B.start, *(A.end - 1))) {
-                            // these two ranges weren't already in order, so we'll need to merge them!
-                            std::copy(A.start, A.end, cache);
-                            MergeExternal(A.start, A.end, B.start, B.end, cache, compare);
-                        }
-                    }
+                    MergeLevelWithCache(Slice(iterator, first, 2, thread, threads), cache, compare);
                 }
+            } else if (iterator.ranges()/2 >= threads) {
+                // rather than sharing one pair of internal buffers across the whole level, each thread pulls out
+                // its own two buffers from within its slice, uses them for its own A and B pairs, then redistributes them
+                // (a slice with too few unique values for full buffers just falls back to the slower merges by itself)
+                MergeLevelInPlace(Slice(iterator, first, 2, thread, threads), cache, cache_size, compare);
             } else {
-                // this is where the in-place merge logic starts!
-                // 1. pull out two internal buffers each containing √A unique values
-                //     1a. adjust block_size and buffer_size if we couldn't find enough unique values
-                // 2. loop over the A and B subarrays within this level of the merge sort
-                //     3. break A and B into blocks of size 'block_size'
-                //     4. "tag" each of the A blocks with values from the first internal buffer
-                //     5. roll the A blocks through the B blocks and drop/rotate them where they belong
-                //     6. merge each A block with any B values that follow, using the cache or the second internal buffer
-                // 7. sort the second internal buffer if it exists
-                // 8. redistribute the two internal buffers back into the array
-
-                std::size_t block_size = std::sqrt(iterator.length());
-                std::size_t buffer_size = iterator.length()/block_size + 1;
-
-                // as an optimization, we really only need to pull out the internal buffers once for each level of merges
-                // after that we can reuse the same buffers over and over, then redistribute it when we're finished with this level
-                Range<RandomAccessIterator> buffer1(first, first);
-                Range<RandomAccessIterator> buffer2(first, first);
-                RandomAccessIterator index, last;
-                std::size_t count, pull_index = 0;
-                struct
-                {
-                    RandomAccessIterator from, to;
-                    std::size_t count;
-                    Range<RandomAccessIterator> range;
-                } pull[2];
-                pull[0].count = 0; pull[0].range = Range<RandomAccessIterator>(first, first);
-                pull[1].count = 0; pull[1].range = Range<RandomAccessIterator>(first, first);
-
-                // find two internal buffers of size 'buffer_size' each
-                // let's try finding both buffers at the same time from a single A or B subarray
-                std::size_t find = buffer_size + buffer_size;
-                bool find_separately = false;
-
-                if (block_size <= cache_size) {
-                    // if every A block fits into the cache then we won't need the second internal buffer,
-                    // so we really only need to find 'buffer_size' unique values
-                    find = buffer_size;
-                } else if (find > iterator.length()) {
-                    // we can't fit both buffers into the same A or B subarray, so find two buffers separately
-                    find = buffer_size;
-                    find_separately = true;
+                // at the last few levels there are fewer A and B pairs than threads, so give each pair a group of threads
+                // and split the merge itself between them. any threads left over have empty ranges to "merge"
+                std::size_t pairs = iterator.ranges()/2, group = threads/pairs, pair = thread/group;
+                Range<RandomAccessIterator> A (first, first), B (first, first);
+                if (pair < pairs) {
+                    Wiki::Iterator it (iterator);
+                    it.seek(pair * 2);
+                    A = it.nextRange(first);
+                    B = it.nextRange(first);
                 }
+                ParallelMerge(A, B, cache, cache_size, compare, thread % group, group, barrier);
+            }
 
-                // we need to find either a single contiguous space containing 2√A unique values (which will be split up into two buffers of size √A each),
-                // or we need to find one buffer of < 2√A unique values, and a second buffer of √A unique values,
-                // OR if we couldn't find that many unique values, we need the largest possible buffer we can get
-
-                // in the case where it couldn't find a single buffer of at least √A unique values,
-                // all of the Merge steps must be replaced by a different merge algorithm (MergeInPlace)
-
-                iterator.begin();
-                while (!iterator.finished()) {
-                    Range<RandomAccessIterator> A = iterator.nextRange(first);
-                    Range<RandomAccessIterator> B = iterator.nextRange(first);
-
-                    // just store information about where the values will be pulled from and to,
-                    // as well as how many values there are, to create the two internal buffers
-                    #define PULL(_to) \
-                        pull[pull_index].range = Range<RandomAccessIterator>(A.start, B.end); \
-                        pull[pull_index].count = count; \
-                        pull[pull_index].from = index; \
-                        pull[pull_index].to = _to
-
-                    // check A for the number of unique values we need to fill an internal buffer
-                    // these values will be pulled out to the start of A
-                    for (last = A.start, count = 1; count < find; last = index, ++count) {
-                        index = FindLastForward(last + 1, A.end, *last, compare, find - count);
-                        if (index == A.end) break;
-                        assert(index < A.end);
-                    }
-                    index = last;
-
-                    if (count >= buffer_size) {
-                        // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
-                        PULL(A.start);
-                        pull_index = 1;
-
-                        if (count == buffer_size + buffer_size) {
-                            // we were able to find a single contiguous section containing 2√A unique values,
-                            // so this section can be used to contain both of the internal buffers we'll need
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + buffer_size);
-                            buffer2 = Range<RandomAccessIterator>(A.start + buffer_size, A.start + count);
-                            break;
-                        } else if (find == buffer_size + buffer_size) {
-                            // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
-                            // so we still need to find a second separate buffer of at least √A unique values
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            find = buffer_size;
-                        } else if (block_size <= cache_size) {
-                            // we found the first and only internal buffer that we need, so we're done!
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            break;
-                        } else if (find_separately) {
-                            // found one buffer, but now find the other one
-                            buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            find_separately = false;
-                        } else {
-                            // we found a second buffer in an 'A' subarray containing √A unique values, so we're done!
-                            buffer2 = Range<RandomAccessIterator>(A.start, A.start + count);
-                            break;
-                        }
-                    } else if (pull_index == 0 && count > buffer1.length()) {
-                        // keep track of the largest buffer we were able to find
-                        buffer1 = Range<RandomAccessIterator>(A.start, A.start + count);
-                        PULL(A.start);
-                    }
+            // every slice of this level needs to be merged before starting on the next one
+            barrier.wait();
+            if (!iterator.nextLevel()) break;
+        }
+    }
 
-                    // check B for the number of unique values we need to fill an internal buffer
-                    // these values will be pulled out to the end of B
-                        for (last = B.end - 1, count = 1; count < find; last = index - 1, ++count) {
-                            index = FindFirstBackward(B.start, last, *last, compare, find - count);
-                            if (index == B.start) break;
-                            assert(index > B.start);
-                        }
-                        index = last;
-
-                    if (count >= buffer_size) {
-                        // keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer
-                        PULL(B.end);
-                        pull_index = 1;
-
-                        if (count == buffer_size + buffer_size) {
-                            // we were able to find a single contiguous section containing 2√A unique values,
-                            // so this section can be used to contain both of the internal buffers we'll need
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end - buffer_size);
-                            buffer2 = Range<RandomAccessIterator>(B.end - buffer_size, B.end);
-                            break;
-                        } else if (find == buffer_size + buffer_size) {
-                            // we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values,
-                            // so we still need to find a second separate buffer of at least √A unique values
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
-                            find = buffer_size;
-                        } else if (block_size <= cache_size) {
-                            // we found the first and only internal buffer that we need, so we're done!
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end );
-                            break;
-                        } else if (find_separately) {
-                            // found one buffer, but now find the other one
-                            buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
-                            find_separately = false;
-                        } else {
-                            // buffer2 will be pulled out from a 'B' subarray, so if the first buffer was pulled out from the corresponding 'A' subarray,
-                            // we need to adjust the end point for that A subarray so it knows to stop redistributing its values before reaching buffer2
-                            if (pull[0].range.start == A.start) {
-                                pull[0].range.end -= pull[1].count;
-                            }
+    // the same sort as above, but with each level of the merge sort split across multiple threads
+    // (the comparison must be safe to call from several threads at the same time, and must not throw)
+    template <typename RandomAccessIterator, typename Comparison>
+    void ParallelSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, std::size_t threads) {
+        const std::size_t size = std::distance(first, last);
 
-                            // we found a second buffer in a 'B' subarray containing √A unique values, so we're done!
-                            buffer2 = Range<RandomAccessIterator>(B.end - count, B.end);
-                            break;
-                        }
-                    } else if (pull_index == 0 && count > buffer1.length()) {
-                        // keep track of the largest buffer we were able to find
-                        buffer1 = Range<RandomAccessIterator>(B.end - count, B.end);
-                        PULL(B.end);
-                    }
+        // it isn't worth starting up threads that would have fewer than this many items to sort
+        const std::size_t min_items = 4096;
+        threads = std::min(threads, size / min_items);
+        if (threads <= 1) {
+            Sort(first, last, compare);
+            return;
+        }
 
-                    #undef PULL
-                }
+        Barrier barrier (threads);
+        std::vector<std::thread> workers;
+        try {
+            workers.reserve(threads - 1);
+            for (std::size_t thread = 1; thread < threads; ++thread) {
+                workers.emplace_back(ParallelWorker<RandomAccessIterator, Comparison>,
+                                     first, last, compare, thread, threads, std::ref(barrier));
+            }
+        } catch (...) {
+            // a thread couldn't be started (or there wasn't memory to keep track of it), so the threads that did start
+            // would wait forever for the rest. they haven't touched the array yet, so send them away and sort it here
+            barrier.cancel();
+            for (std::size_t thread = 0; thread < workers.size(); ++thread) {
+                workers[thread].join();
+            }
+            Sort(first, last, compare);
+            return;
+        }
+        ParallelWorker(first, last, compare, 0, threads, barrier);
+        for (std::size_t thread = 0; thread < workers.size(); ++thread) {
+            workers[thread].join();
+        }
+    }
 
-                // pull out the two ranges so we can use them as internal buffers
-                for (pull_index = 0; pull_index < 2; ++pull_index) {
-                    std::size_t length = pull[pull_index].count;
-
-                    if (pull[pull_index].to < pull[pull_index].from) {
-                        // we're pulling the values out to the left, which means the start of an A subarray
-                        index = pull[pull_index].from;
-                        for (count = 1; count < length; ++count) {
-                            index = FindFirstBackward(pull[pull_index].to, pull[pull_index].from - (count - 1),
-                                                      *(index - 1), compare, length - count);
-                            Range<RandomAccessIterator> range(index + 1, pull[pull_index].from + 1);
-                            std::rotate(range.start, range.end - count, range.end);
-                            pull[pull_index].from = index + count;
-                        }
-                    } else if (pull[pull_index].to > pull[pull_index].from) {
-                        // we're pulling values out to the right, which means the end of a B subarray
-                        index = pull[pull_index].from + 1;
-                        for (count = 1; count < length; ++count) {
-                            index = FindLastForward(index, pull[pull_index].to, *index,
-                                                    compare, length - count);
-                            Range<RandomAccessIterator> range(pull[pull_index].from, index - 1);
-                            std::rotate(range.start, range.start + count, range.end);
-                            pull[pull_index].from = index - count - 1;
-                        }
-                    }
-                }
+    template <typename RandomAccessIterator, typename Comparison>
+    void ParallelSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        ParallelSort(first, last, compare, std::max(std::thread::hardware_concurrency(), 1u));
+    }
 
-                // adjust block_size and buffer_size based on the values we were able to pull out
-                buffer_size = buffer1.length();
-                block_size = iterator.length() / buffer_size + 1;
-
-                // the first buffer NEEDS to be large enough to tag each of the evenly sized A blocks,
-                // so this was originally here to test the math for adjusting block_size above
-                //assert((iterator.length() + 1)/block_size <= buffer_size);
-
-                // now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort!
-                iterator.begin();
-                while (!iterator.finished()) {
-                    Range<RandomAccessIterator> A = iterator.nextRange(first);
-                    Range<RandomAccessIterator> B = iterator.nextRange(first);
-
-                    // remove any parts of A or B that are being used by the internal buffers
-                    RandomAccessIterator start = A.start;
-                    if (start == pull[0].range.start) {
-                        if (pull[0].from > pull[0].to) {
-                            A.start += pull[0].count;
-
-                            // if the internal buffer takes up the entire A or B subarray, then there's nothing to merge
-                            // this only happens for very small subarrays, like √4 = 2, 2 * (2 internal buffers) = 4,
-                            // which also only happens when cache_size is small or 0 since it'd otherwise use MergeExternal
-                            if (A.length() == 0) continue;
-                        } else if (pull[0].from < pull[0].to) {
-                            B.end -= pull[0].count;
-                            if (B.length() == 0) continue;
-                        }
-                    }
-                    if (start == pull[1].range.start) {
-                        if (pull[1].from > pull[1].to) {
-                            A.start += pull[1].count;
-                            if (A.length() == 0) continue;
-                        } else if (pull[1].from < pull[1].to) {
-                            B.end -= pull[1].count;
-                            if (B.length() == 0) continue;
-                        }
-                    }
+    // something for the Scheduler to run, which lives on the stack of whoever spawned it until it's done
+    class Task {
+    public:
+        std::atomic<bool> done;
 
-                    if (compare(*(B.end - 1), *A.start)) {
-                        // the two ranges are in reverse order, so a simple rotation should fix it
-                        std::rotate(A.start, A.end, B.end);
-                    } else if (compare(*A.end, *(A.end - 1))) {
-                        // these two ranges weren't already in order, so we'll need to merge them!
-
-                        // break the remainder of A into blocks. firstA is the uneven-sized first A block
-                        Range<RandomAccessIterator> blockA(A);
-                        Range<RandomAccessIterator> firstA(A.start, A.start + blockA.length() % block_size);
-
-                        // swap the first value of each A block with the values in buffer1
-                        for (RandomAccessIterator indexA = buffer1.start, index = firstA.end;
-                             index < blockA.end;
-                             ++indexA, index += block_size) {
-                            std::iter_swap(indexA, index);
-                        }
+        Task(): done(false) {}
+        virtual ~Task() {}
 
-                        // start rolling the A blocks through the B blocks!
-                        // when we leave an A block behind we'll need to merge the previous A block with any B blocks that follow it, so track that information as well
-                        Range<RandomAccessIterator> lastA (firstA);
-                        Range<RandomAccessIterator> lastB (first, first);
-                        Range<RandomAccessIterator> blockB (B.start, B.start + std::min(block_size, B.length()));
-                        blockA.start += firstA.length();
-                        RandomAccessIterator indexA = buffer1.start;
-
-                        // if the first unevenly sized A block fits into the cache, copy it there for when we go to Merge it
-                        // otherwise, if the second buffer is available, block swap the contents into that
-                        if (lastA.length() <= cache_size) {
-                            std::copy(lastA.start, lastA.end, cache);
-                        } else if (buffer2.length() > 0) {
-                            std::swap_ranges(lastA.start, lastA.end, buffer2.start);
-                        }
+        // 'worker' is the index of the scheduler thread running this task
+        virtual void run(std::size_t worker) = 0;
+    };
 
-                        if (blockA.length() > 0) {
-                            while (true) {
-                                // if there's a previous B block and the first value of the minimum A block is <= the last value of the previous B block,
-                                // then drop that minimum A block behind. or if there are no B blocks left then keep dropping the remaining A blocks.
-                                if ((lastB.length() > 0 && !compare(*(lastB.end - 1), *indexA)) ||
-                                    blockB.length() == 0) {
-                                    // figure out where to split the previous B block, and rotate it at the split
-                                    RandomAccessIterator B_split = std::lower_bound(lastB.start, lastB.end, *indexA, compare);
-                                    std::size_t B_remaining = std::distance(B_split, lastB.end);
-
-                                    // swap the minimum A block to the beginning of the rolling A blocks
-                                    RandomAccessIterator minA = blockA.start;
-                                    for (RandomAccessIterator findA = minA + block_size ; findA < blockA.end ; findA += block_size) {
-                                        if (compare(*findA, *minA)) {
-                                            minA = findA;
-                                        }
-                                    }
-                                    std::swap_ranges(blockA.start, blockA.start + block_size, minA);
-
-                                    // swap the first item of the previous A block back with its original value, which is stored in buffer1
-                                    std::iter_swap(blockA.start, indexA);
-                                    ++indexA;
-
-                                    // locally merge the previous A block with the B values that follow it
-                                    // if lastA fits into the external cache we'll use that (with MergeExternal),
-                                    // or if the second internal buffer exists we'll use that (with MergeInternal),
-                                    // or failing that we'll use a strictly in-place merge algorithm (MergeInPlace)
-                                    if (lastA.length() <= cache_size) {
-                                        MergeExternal(lastA.start, lastA.end, lastA.end, B_split, cache, compare);
-                                    } else if (buffer2.length() > 0) {
-                                        MergeInternal(lastA.start, lastA.end, lastA.end, B_split, buffer2.start, compare);
-                                    } else {
-                                        MergeInPlace(lastA.start, lastA.end, lastA.end, B_split, compare);
-                                    }
-
-                                    if (buffer2.length() > 0 || block_size <= cache_size) {
-                                        // copy the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway
-                                        if (block_size <= cache_size) {
-                                            std::copy(blockA.start, blockA.start + block_size, cache);
-                                        } else {
-                                            std::swap_ranges(blockA.start, blockA.start + block_size, buffer2.start);
-                                        }
-
-                                        // this is equivalent to rotating, but faster
-                                        // the area normally taken up by the A block is either the contents of buffer2, or data we don't need anymore since we memcopied it
-                                        // either way we don't need to retain the order of those items, so instead of rotating we can just block swap B to where it belongs
-                                        std::swap_ranges(B_split, B_split + B_remaining, blockA.start + block_size - B_remaining);
-                                    } else {
-                                        // we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation
-                                        std::rotate(B_split, blockA.start, blockA.start + block_size);
-                                    }
-
-                                    // update the range for the remaining A blocks, and the range remaining from the B block after it was split
-                                    lastA = Range<RandomAccessIterator>(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
-                                    lastB = Range<RandomAccessIterator>(lastA.end, lastA.end + B_remaining);
-
-                                    // if there are no more A blocks remaining, this step is finished!
-                                    blockA.start += block_size;
-                                    if (blockA.length() == 0) break;
-
-                                } else if (blockB.length() < block_size) {
-                                    // move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation
-                                    std::rotate(blockA.start, blockB.start, blockB.end);
-
-                                    lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + blockB.length());
-                                    blockA.start += blockB.length();
-                                    blockA.end += blockB.length();
-                                    blockB.end = blockB.start;
-                                } else {
-                                    // roll the leftmost A block to the end by swapping it with the next B block
-                                    std::swap_ranges(blockA.start, blockA.start + block_size, blockB.start);
-                                    lastB = Range<RandomAccessIterator>(blockA.start, blockA.start + block_size);
-
-                                    blockA.start += block_size;
-                                    blockA.end += block_size;
-                                    blockB.start += block_size;
-
-                                    if (blockB.end > B.end - block_size) {
-                                        blockB.end = B.end;
-                                    } else {
-                                        blockB.end += block_size;
-                                    }
-                                }
-                            }
-                        }
+    // lock-free work-stealing deque (Chase and Lev, "Dynamic Circular Work-Stealing Deque", SPAA 2005)
+    // the owning thread pushes and pops at the bottom, while other threads steal from the top
+    // top and bottom use sequentially consistent operations rather than the fences from the paper, which is simpler to reason about
+    class Deque {
+        static const long capacity = 1024;
+        std::atomic<long> top, bottom;
+        std::atomic<Task *> tasks[capacity];
 
-                        // merge the last A block with the remaining B values
-                        if (lastA.length() <= cache_size) {
-                            MergeExternal(lastA.start, lastA.end, lastA.end, B.end, cache, compare);
-                        } else if (buffer2.length() > 0) {
-                            MergeInternal(lastA.start, lastA.end, lastA.end, B.end, buffer2.start, compare);
-                        } else {
-                            MergeInPlace(lastA.start, lastA.end, lastA.end, B.end, compare);
-                        }
-                    }
+    public:
+
+        Deque(): top(0), bottom(0) {}
+
+        // returns false if the deque is full, in which case the owner should just run the task itself
+        bool push(Task *task) {
+            long b = bottom.load(std::memory_order_relaxed);
+            long t = top.load(std::memory_order_acquire);
+            if (b - t >= capacity) return false;
+
+            tasks[b & (capacity - 1)].store(task, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_release);
+            return true;
+        }
+
+        Task *pop() {
+            long b = bottom.load(std::memory_order_relaxed) - 1;
+            bottom.store(b);
+            long t = top.load();
+
+            if (t > b) {
+                // the deque was already empty
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return NULL;
+            }
+
+            Task *task = tasks[b & (capacity - 1)].load(std::memory_order_relaxed);
+            if (t == b) {
+                // this is the last task, so race any thieves for it
+                if (!top.compare_exchange_strong(t, t + 1)) task = NULL;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+
+        Task *steal() {
+            long t = top.load();
+            long b = bottom.load();
+            if (t >= b) return NULL;
+
+            Task *task = tasks[t & (capacity - 1)].load(std::memory_order_relaxed);
+            if (!top.compare_exchange_strong(t, t + 1)) return NULL;
+            return task;
+        }
+    };
+
+    // a fixed set of threads, each with its own deque of tasks, that steal from each other whenever they run out
+    // the thread that creates the scheduler is worker 0, and the rest are started here and stopped when it's destroyed,
+    // so a scheduler only lives for one TaskSort call, and each call pays for starting and joining its threads
+    class Scheduler {
+        std::vector<Deque> deques;
+        std::vector<std::thread> workers;
+        std::atomic<bool> stopping;
+
+        // workers that keep failing to steal anything go to sleep until a task is spawned, rather than spinning
+        // through the parts of the sort that don't have enough work for all of them (like the last few merges)
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::atomic<std::size_t> sleeping;
+        std::size_t signals;
+
+        void execute(std::size_t worker, Task *task) {
+            task->run(worker);
+            task->done.store(true, std::memory_order_release);
+        }
+
+        Task *steal(std::size_t worker) {
+            for (std::size_t victim = 1; victim < deques.size(); ++victim) {
+                Task *task = deques[(worker + victim) % deques.size()].steal();
+                if (task) return task;
+            }
+            return NULL;
+        }
+
+        // wait for spawn() to signal that there might be a task to steal, unless one turns up in the meantime
+        Task *sleep(std::size_t worker) {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::size_t current = signals;
+
+            // check once more now that spawn() knows this thread is sleeping, in case a task was pushed just before
+            ++sleeping;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            lock.unlock();
+            Task *task = steal(worker);
+            lock.lock();
+
+            while (!task && signals == current && !stopping.load(std::memory_order_acquire)) condition.wait(lock);
+            --sleeping;
+            return task;
+        }
+
+        void work(std::size_t worker) {
+            std::size_t failures = 0;
+            while (!stopping.load(std::memory_order_acquire)) {
+                Task *task = steal(worker);
+                if (!task && ++failures >= 64) {
+                    task = sleep(worker);
+                    failures = 0;
+                }
+                if (task) {
+                    execute(worker, task);
+                    failures = 0;
+                } else {
+                    std::this_thread::yield();
                 }
+            }
+        }
 
-                // when we're finished with this merge step we should have the one or two internal buffers left over, where the second buffer is all jumbled up
-                // insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer
-
-                // while an unstable sort like std::sort could be applied here, in benchmarks it was consistently slightly slower than a simple insertion sort,
-                // even for tens of millions of items. this may be because insertion sort is quite fast when the data is already somewhat sorted, like it is here
-                InsertionSort(buffer2.start, buffer2.end, compare);
-
-                for (pull_index = 0 ; pull_index < 2 ; ++pull_index) {
-                    std::size_t unique = pull[pull_index].count * 2;
-                    if (pull[pull_index].from > pull[pull_index].to) {
-                        // the values were pulled out to the left, so redistribute them back to the right
-                        Range<RandomAccessIterator> buffer(
-                            pull[pull_index].range.start,
-                            pull[pull_index].range.start + pull[pull_index].count
-                        );
-                        while (buffer.length() > 0) {
-                            index = FindFirstForward(buffer.end, pull[pull_index].range.end,
-                                                     *buffer.start, compare, unique);
-                            std::size_t amount = index - buffer.end;
-                            std::rotate(buffer.start, buffer.end, index);
-                            buffer.start += (amount + 1);
-                            buffer.end += amount;
-                            unique -= 2;
-                        }
-                    } else if (pull[pull_index].from < pull[pull_index].to) {
-                        // the values were pulled out to the right, so redistribute them back to the left
-                        Range<RandomAccessIterator> buffer(
-                            pull[pull_index].range.end - pull[pull_index].count,
-                            pull[pull_index].range.end
-                        );
-                        while (buffer.length() > 0) {
-                            index = FindLastBackward(pull[pull_index].range.start, buffer.start,
-                                                     *(buffer.end - 1), compare, unique);
-                            std::size_t amount = buffer.start - index;
-                            std::rotate(index, index + amount, buffer.end);
-                            buffer.start -= amount;
-                            buffer.end -= (amount + 1);
-                            unique -= 2;
-                        }
-                    }
+    public:
+
+        Scheduler(std::size_t threads):
+            deques(threads),
+            stopping(false),
+            sleeping(0),
+            signals(0)
+        {
+            // the calling thread is worker 0, and can run every task by itself if it has to
+            // so if a thread can't be started, keep going with the ones that were (their deques just stay empty)
+            try {
+                workers.reserve(threads - 1);
+                for (std::size_t worker = 1; worker < threads; ++worker) {
+                    workers.emplace_back(&Scheduler::work, this, worker);
                 }
+            } catch (...) {}
+        }
+
+        ~Scheduler() {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stopping.store(true, std::memory_order_release);
+                condition.notify_all();
+            }
+            for (std::size_t worker = 0; worker < workers.size(); ++worker) {
+                workers[worker].join();
             }
+        }
 
-            // double the size of each A and B subarray that will be merged in the next level
-            if (!iterator.nextLevel()) break;
+        // make the task available for other threads to steal, or run it right away if the deque is full
+        void spawn(std::size_t worker, Task & task) {
+            if (!deques[worker].push(&task)) {
+                execute(worker, &task);
+                return;
+            }
+
+            // this fence pairs with the one in sleep(), so either a worker going to sleep is counted here,
+            // or its last steal() before it goes to sleep will find the task
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleeping.load(std::memory_order_relaxed) > 0) {
+                std::unique_lock<std::mutex> lock(mutex);
+                ++signals;
+                condition.notify_one();
+            }
+        }
+
+        // wait for a spawned task to finish, running our own tasks or stealing other ones in the meantime
+        // (every spawned task must be waited on before the one that spawned it returns)
+        void wait(std::size_t worker, Task & task) {
+            while (!task.done.load(std::memory_order_acquire)) {
+                Task *next = deques[worker].pop();
+                if (!next) next = steal(worker);
+                if (next) execute(worker, next);
+                else std::this_thread::yield();
+            }
+        }
+    };
+
+    // subarrays smaller than this are sorted or merged by one thread, while they're still hot in its cache
+    const std::size_t task_items = 16384;
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void TaskMerge(Scheduler & scheduler, std::size_t worker,
+                   Range<RandomAccessIterator> A, Range<RandomAccessIterator> B, Comparison compare);
+
+    template <typename RandomAccessIterator, typename Comparison>
+    class MergeTask : public Task {
+        Scheduler & scheduler;
+        Range<RandomAccessIterator> A, B;
+        Comparison compare;
+
+    public:
+
+        MergeTask(Scheduler & scheduler, Range<RandomAccessIterator> A, Range<RandomAccessIterator> B, Comparison compare):
+            scheduler(scheduler),
+            A(A),
+            B(B),
+            compare(compare)
+        {}
+
+        void run(std::size_t worker) {
+            TaskMerge(scheduler, worker, A, B, compare);
+        }
+    };
+
+    // merge A and B on a single thread, using a fixed-size cache on this thread's stack
+    template <typename RandomAccessIterator, typename Comparison>
+    void MergeWithCache(Range<RandomAccessIterator> A, Range<RandomAccessIterator> B, Comparison compare) {
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+        const std::size_t cache_size = StackCache<WIKISORT_CACHE_BYTES>::Items<T>::value;
+        StackArray<T, cache_size> memory;
+        CacheItems<T> cache (memory.data(), std::min(cache_size, A.length() + B.length()), A.start);
+        MergePair(A, B, cache.data(), cache.size(), compare);
+    }
+
+    template <typename RandomAccessIterator>
+    void TaskReverse(Scheduler & scheduler, std::size_t worker,
+                     RandomAccessIterator first, RandomAccessIterator last, std::size_t from, std::size_t to);
+
+    template <typename RandomAccessIterator>
+    class ReverseTask : public Task {
+        Scheduler & scheduler;
+        RandomAccessIterator first, last;
+        std::size_t from, to;
+
+    public:
+
+        ReverseTask(Scheduler & scheduler, RandomAccessIterator first, RandomAccessIterator last, std::size_t from, std::size_t to):
+            scheduler(scheduler),
+            first(first),
+            last(last),
+            from(from),
+            to(to)
+        {}
+
+        void run(std::size_t worker) {
+            TaskReverse(scheduler, worker, first, last, from, to);
+        }
+    };
+
+    // swap items [from, to) of the range with the ones the same distance from its end, like ReverseSlice,
+    // splitting them into tasks so other threads can take part in reversing a large range
+    template <typename RandomAccessIterator>
+    void TaskReverse(Scheduler & scheduler, std::size_t worker,
+                     RandomAccessIterator first, RandomAccessIterator last, std::size_t from, std::size_t to) {
+        if (to - from <= task_items) {
+            std::swap_ranges(first + from, first + to, std::reverse_iterator<RandomAccessIterator>(last - from));
+            return;
+        }
+
+        std::size_t mid = from + (to - from)/2;
+        ReverseTask<RandomAccessIterator> left (scheduler, first, last, from, mid);
+        scheduler.spawn(worker, left);
+        TaskReverse(scheduler, worker, first, last, mid, to);
+        scheduler.wait(worker, left);
+    }
+
+    // std::rotate, but as three reversals that other threads can help with, like the rotations in ParallelMerge,
+    // so the top merges don't have to wait on one thread moving half of their items
+    template <typename RandomAccessIterator>
+    void TaskRotate(Scheduler & scheduler, std::size_t worker,
+                    RandomAccessIterator first, RandomAccessIterator middle, RandomAccessIterator last) {
+        if (first == middle || middle == last) return;
+        if ((std::size_t)std::distance(first, last) <= task_items) {
+            std::rotate(first, middle, last);
+            return;
+        }
+
+        ReverseTask<RandomAccessIterator> left (scheduler, first, middle, 0, std::distance(first, middle)/2);
+        scheduler.spawn(worker, left);
+        TaskReverse(scheduler, worker, middle, last, 0, std::distance(middle, last)/2);
+        scheduler.wait(worker, left);
+        TaskReverse(scheduler, worker, first, last, 0, std::distance(first, last)/2);
+    }
+
+    // split the merge in half along the merge path, rotate the two middle parts past each other,
+    // then merge each half as a separate task
+    template <typename RandomAccessIterator, typename Comparison>
+    void TaskMerge(Scheduler & scheduler, std::size_t worker,
+                   Range<RandomAccessIterator> A, Range<RandomAccessIterator> B, Comparison compare) {
+        if (A.length() == 0 || B.length() == 0 || !compare(*B.start, *(A.end - 1))) return;
+
+        if (A.length() + B.length() <= task_items) {
+            MergeWithCache(A, B, compare);
+            return;
+        }
+
+        std::size_t rank = (A.length() + B.length())/2;
+        std::size_t split_A = CoRank(A, B, rank, compare);
+        std::size_t split_B = rank - split_A;
+        TaskRotate(scheduler, worker, A.start + split_A, A.end, B.start + split_B);
+
+        RandomAccessIterator mid = A.start + rank;
+        MergeTask<RandomAccessIterator, Comparison> left (scheduler,
+            Range<RandomAccessIterator>(A.start, A.start + split_A),
+            Range<RandomAccessIterator>(A.start + split_A, mid), compare);
+        scheduler.spawn(worker, left);
+        TaskMerge(scheduler, worker,
+                  Range<RandomAccessIterator>(mid, mid + (A.length() - split_A)),
+                  Range<RandomAccessIterator>(mid + (A.length() - split_A), B.end), compare);
+        scheduler.wait(worker, left);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void TaskSortRange(Scheduler & scheduler, std::size_t worker,
+                       RandomAccessIterator first, RandomAccessIterator last, Comparison compare);
+
+    template <typename RandomAccessIterator, typename Comparison>
+    class SortTask : public Task {
+        Scheduler & scheduler;
+        RandomAccessIterator first, last;
+        Comparison compare;
+
+    public:
+
+        SortTask(Scheduler & scheduler, RandomAccessIterator first, RandomAccessIterator last, Comparison compare):
+            scheduler(scheduler),
+            first(first),
+            last(last),
+            compare(compare)
+        {}
+
+        void run(std::size_t worker) {
+            TaskSortRange(scheduler, worker, first, last, compare);
+        }
+    };
+
+    // sort each half as a separate task (depth-first, so small subarrays are finished while they're still in the cache),
+    // then merge the two halves together
+    template <typename RandomAccessIterator, typename Comparison>
+    void TaskSortRange(Scheduler & scheduler, std::size_t worker,
+                       RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        const std::size_t size = std::distance(first, last);
+        if (size <= task_items) {
+            Sort(first, last, compare);
+            return;
+        }
+
+        RandomAccessIterator mid = first + size/2;
+        SortTask<RandomAccessIterator, Comparison> left (scheduler, first, mid, compare);
+        scheduler.spawn(worker, left);
+        TaskSortRange(scheduler, worker, mid, last, compare);
+        scheduler.wait(worker, left);
+
+        TaskMerge(scheduler, worker, Range<RandomAccessIterator>(first, mid), Range<RandomAccessIterator>(mid, last), compare);
+    }
+
+    // recursive, task-based version of ParallelSort which avoids having every thread wait at the end of each level,
+    // since idle threads steal unfinished subarrays from the other threads instead
+    // (the comparison must be safe to call from several threads at the same time, and must not throw)
+    template <typename RandomAccessIterator, typename Comparison>
+    void TaskSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare, std::size_t threads) {
+        const std::size_t size = std::distance(first, last);
+        if (threads <= 1 || size <= task_items) {
+            Sort(first, last, compare);
+            return;
         }
+
+        // the scheduler's threads only last for this call
+        Scheduler scheduler (threads);
+        TaskSortRange(scheduler, 0, first, last, compare);
+    }
+
+    template <typename RandomAccessIterator, typename Comparison>
+    void TaskSort(RandomAccessIterator first, RandomAccessIterator last, Comparison compare) {
+        TaskSort(first, last, compare, std::max(std::thread::hardware_concurrency(), 1u));
     }
 }
 
@@ -1036,6 +3513,39 @@ void Verify(Iterator start, Iterator end, const Comparison compare, const string
         }
     }
 }
+
+// sort primitive keys with std::less, which uses the SIMD sorting networks when they're enabled,
+// and make sure the result matches std::stable_sort exactly, including the original order of -0.0 and 0.0
+// (sorting without a buffer as well, since that goes through the block merges and their SIMD searches)
+template <typename T>
+void VerifyPrimitive(const vector<T> & unsorted) {
+    vector<T> array1 (unsorted), array2 (unsorted), array3 (unsorted);
+    Wiki::Sort(array1.begin(), array1.end(), less<T>());
+    Wiki::Sort(array3.begin(), array3.end(), less<T>(), (T *)NULL, 0);
+    stable_sort(array2.begin(), array2.end(), less<T>());
+    for (size_t index = 0; index < array1.size(); index++) {
+        assert(array1[index] == array2[index] && signbit(array1[index]) == signbit(array2[index]));
+        assert(array3[index] == array2[index] && signbit(array3[index]) == signbit(array2[index]));
+    }
+}
+
+// merge two sorted halves of primitive keys with std::less and a buffer, which uses the SIMD merge for integers,
+// splitting an odd number of keys so the halves are rarely a multiple of the lane count, to reach the merge's tail
+template <typename T>
+void VerifyPrimitiveMerge(const vector<T> & unsorted) {
+    const size_t total = unsorted.size() - (unsorted.size() % 2 == 0);
+    const size_t splits[] = { 1, 13, 1001, total/2 + 3, total - 6 };
+    vector<T> sorted (unsorted.begin(), unsorted.begin() + total);
+    stable_sort(sorted.begin(), sorted.end(), less<T>());
+    for (size_t split_index = 0; split_index < sizeof(splits)/sizeof(splits[0]); split_index++) {
+        if (splits[split_index] >= total) continue;
+        vector<T> array1 (unsorted.begin(), unsorted.begin() + total), buffer (total);
+        stable_sort(array1.begin(), array1.begin() + splits[split_index], less<T>());
+        stable_sort(array1.begin() + splits[split_index], array1.end(), less<T>());
+        Wiki::Merge(array1.begin(), array1.begin() + splits[split_index], array1.end(), less<T>(), buffer.data(), buffer.size());
+        assert(array1 == sorted);
+    }
+}
 #endif
 
 namespace Testing {
@@ -1088,8 +3598,8 @@ int main() {
     vector<Test> array1, array2;
 
     #if PROFILE
-        size_t compares1, compares2, total_compares1 = 0, total_compares2 = 0;
-        size_t assigns1, assigns2, total_assigns1 = 0, total_assigns2 = 0;
+        size_t compares1, compares2, total_compares2 = 0;
+        size_t assigns1, assigns2, total_assigns2 = 0;
     #endif
 
     // initialize the random-number generator
@@ -1123,21 +3633,217 @@ int main() {
 
             array1[index] = array2[index] = item;
         }
+        vector<Test> array3 (array1);
+        const vector<Test> unsorted (array1);
+
         Wiki::Sort(array1.begin(), array1.end(), compare);
         stable_sort(array2.begin(), array2.end(), compare);
 
         Verify(array1.begin(), array1.end(), compare, "test case failed");
         for (size_t index = 0; index < total; index++)
             assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+
+        vector<Test> array4 (array3);
+        Wiki::ParallelSort(array3.begin(), array3.end(), compare, 4);
+        Verify(array3.begin(), array3.end(), compare, "parallel test case failed");
+        for (size_t index = 0; index < total; index++)
+            assert(!compare(array3[index], array2[index]) && !compare(array2[index], array3[index]));
+
+        Wiki::TaskSort(array4.begin(), array4.end(), compare, 4);
+        Verify(array4.begin(), array4.end(), compare, "task test case failed");
+        for (size_t index = 0; index < total; index++)
+            assert(!compare(array4[index], array2[index]) && !compare(array2[index], array4[index]));
+
+        // sort with each of the cache policies
+        const Wiki::CachePolicy test_policies[] = {
+            Wiki::CachePolicy(Wiki::CachePolicy::SquareRoot),
+            Wiki::CachePolicy(Wiki::CachePolicy::Half),
+            Wiki::CachePolicy::Bytes(1000 * sizeof(Test))
+        };
+        for (size_t policy = 0; policy < sizeof(test_policies)/sizeof(test_policies[0]); policy++) {
+            vector<Test> array5 (unsorted);
+            Wiki::Sort(array5.begin(), array5.end(), compare, test_policies[policy]);
+            Verify(array5.begin(), array5.end(), compare, "cache policy test case failed");
+            for (size_t index = 0; index < total; index++)
+                assert(!compare(array5[index], array2[index]) && !compare(array2[index], array5[index]));
+        }
+
+        // and with stack caches of other sizes, including one too small to hold any items
+        vector<Test> array7 (unsorted), array8 (unsorted);
+        Wiki::Sort(array7.begin(), array7.end(), compare, Wiki::StackCache<sizeof(Test) - 1>());
+        Wiki::Sort(array8.begin(), array8.end(), compare, Wiki::StackCache<1024>());
+        Verify(array7.begin(), array7.end(), compare, "empty stack cache test case failed");
+        Verify(array8.begin(), array8.end(), compare, "stack cache test case failed");
+        for (size_t index = 0; index < total; index++) {
+            assert(!compare(array7[index], array2[index]) && !compare(array2[index], array7[index]));
+            assert(!compare(array8[index], array2[index]) && !compare(array2[index], array8[index]));
+        }
+
+        // and with move-only items, which can only be moved into and out of the cache
+        vector<unique_ptr<Test> > pointers;
+        for (size_t index = 0; index < total; index++)
+            pointers.push_back(unique_ptr<Test>(new Test(unsorted[index])));
+        Wiki::Sort(pointers.begin(), pointers.end(),
+                   [compare](const unique_ptr<Test> & a, const unique_ptr<Test> & b) { return compare(*a, *b); });
+        for (size_t index = 0; index < total; index++)
+            assert(pointers[index]->index == array2[index].index);
+
+        // and indirectly, by sorting the keys then moving the items into place
+        vector<Test> array9 (unsorted);
+        Wiki::SortIndirect(array9.begin(), array9.end(), [](const Test & item) { return item.value; });
+        for (size_t index = 0; index < total; index++)
+            assert(array9[index].index == array2[index].index);
+
+        // and by a projected key, with the keys cached or not
+        vector<Test> array10 (unsorted), array11 (unsorted);
+        Wiki::SortBy(array10.begin(), array10.end(), [](const Test & item) { return item.value; });
+        Wiki::SortBy(array11.begin(), array11.end(), [](const Test & item) { return item.value; },
+                     less<size_t>(), Wiki::RecomputeKeys);
+        for (size_t index = 0; index < total; index++) {
+            assert(array10[index].index == array2[index].index);
+            assert(array11[index].index == array2[index].index);
+        }
+
+        // and with a memory budget too small for the policy's cache
+        Wiki::SetCacheBudget(64 * sizeof(Test));
+        vector<Test> array6 (unsorted);
+        Wiki::Sort(array6.begin(), array6.end(), compare, Wiki::CachePolicy(Wiki::CachePolicy::Half));
+        Verify(array6.begin(), array6.end(), compare, "cache budget test case failed");
+        for (size_t index = 0; index < total; index++)
+            assert(!compare(array6[index], array2[index]) && !compare(array2[index], array6[index]));
+        Wiki::SetCacheBudget(numeric_limits<size_t>::max());
+
+        // merge two sorted halves of different lengths, which should give the same result as sorting the whole thing
+        const size_t splits[] = { 1, total/100, total/2, total - total/100, total - 1 };
+        for (size_t split_index = 0; split_index < sizeof(splits)/sizeof(splits[0]); split_index++) {
+            vector<Test> array5 (unsorted);
+            stable_sort(array5.begin(), array5.begin() + splits[split_index], compare);
+            stable_sort(array5.begin() + splits[split_index], array5.end(), compare);
+            vector<Test> array12 (array5);
+
+            Wiki::InplaceMerge(array5.begin(), array5.begin() + splits[split_index], array5.end(), compare);
+            Wiki::Merge(array12.begin(), array12.begin() + splits[split_index], array12.end(), compare, (Test *)NULL, 0);
+            for (size_t index = 0; index < total; index++) {
+                assert(array5[index].index == array2[index].index);
+                assert(array12[index].index == array2[index].index);
+            }
+        }
+
+        // sort the last fifth of the array after the rest of it has already been sorted
+        vector<Test> array13 (unsorted);
+        stable_sort(array13.begin(), array13.end() - total/5, compare);
+        Wiki::SortAppended(array13.begin(), array13.end() - total/5, array13.end(), compare);
+        for (size_t index = 0; index < total; index++)
+            assert(array13[index].index == array2[index].index);
+
+        // only sort the first tenth of the array, and find the item in the middle
+        vector<Test> array14 (unsorted), array15 (unsorted);
+        Wiki::PartialSort(array14.begin(), array14.begin() + total/10, array14.end(), compare);
+        for (size_t index = 0; index < total/10; index++)
+            assert(array14[index].index == array2[index].index);
+        for (size_t index = total/10; index < total; index++)
+            assert(total/10 == 0 || !compare(array14[index], array14[total/10 - 1]));
+        Wiki::NthElement(array15.begin(), array15.begin() + total/2, array15.end(), compare);
+        assert(array15[total/2].index == array2[total/2].index);
+
+        // stably partition the unsorted items by whether their values are even, with and without a buffer
+        vector<Test> array16 (unsorted), array17 (unsorted), array18 (unsorted);
+        auto even = [](const Test & item) { return item.value % 2 == 0; };
+        vector<Test>::iterator split16 = Wiki::StablePartition(array16.begin(), array16.end(), even);
+        vector<Test>::iterator split17 = Wiki::StablePartition(array17.begin(), array17.end(), even, (Test *)NULL, 0);
+        vector<Test>::iterator split18 = stable_partition(array18.begin(), array18.end(), even);
+        assert(split16 - array16.begin() == split18 - array18.begin());
+        assert(split17 - array17.begin() == split18 - array18.begin());
+        for (size_t index = 0; index < total; index++) {
+            assert(array16[index].index == array18[index].index);
+            assert(array17[index].index == array18[index].index);
+        }
+
+        // sort then remove the duplicates, or find where the runs of equal items are
+        vector<Test> array19 (unsorted), array20 (array2), array21 (unsorted);
+        vector<Range<vector<Test>::iterator> > groups;
+        vector<Test>::iterator end19 = Wiki::SortUnique(array19.begin(), array19.end(), compare);
+        vector<Test>::iterator end20 = unique(array20.begin(), array20.end(),
+                                              [compare](const Test & a, const Test & b) { return !compare(a, b); });
+        Wiki::SortGroups(array21.begin(), array21.end(), compare, back_inserter(groups));
+        assert(end19 - array19.begin() == end20 - array20.begin());
+        assert(groups.size() == (size_t)(end20 - array20.begin()));
+        for (size_t index = 0; index < groups.size(); index++) {
+            assert(array19[index].index == array20[index].index);
+            assert(groups[index].start->index == array20[index].index);
+            assert(groups[index].end == (index + 1 < groups.size() ? groups[index + 1].start : array21.end()));
+        }
+
+        // and the same with a buffer or a cache policy for the sort
+        vector<Test> array22 (unsorted), array23 (unsorted), buffer22 ((total + 1)/2);
+        vector<Range<vector<Test>::iterator> > groups23;
+        vector<Test>::iterator end22 = Wiki::SortUnique(array22.begin(), array22.end(), compare, buffer22.data(), buffer22.size());
+        Wiki::SortGroups(array23.begin(), array23.end(), compare, back_inserter(groups23),
+                         Wiki::CachePolicy(Wiki::CachePolicy::Half));
+        assert(end22 - array22.begin() == end20 - array20.begin());
+        assert(groups23.size() == groups.size());
+        for (size_t index = 0; index < groups23.size(); index++) {
+            assert(array22[index].index == array20[index].index);
+            assert(groups23[index].start->index == array20[index].index);
+            assert(groups23[index].end - groups23[index].start == groups[index].end - groups[index].start);
+        }
+
+        // sort with caller-supplied buffers, from none at all up to half of the array
+        const size_t buffer_lengths[] = { 0, 100, (total + 1)/2 };
+        for (size_t buffer_index = 0; buffer_index < sizeof(buffer_lengths)/sizeof(buffer_lengths[0]); buffer_index++) {
+            vector<Test> buffer (buffer_lengths[buffer_index]);
+            vector<Test> array5 (unsorted);
+            Wiki::Sort(array5.begin(), array5.end(), compare, buffer.data(), buffer.size());
+            Verify(array5.begin(), array5.end(), compare, "buffer test case failed");
+            for (size_t index = 0; index < total; index++)
+                assert(!compare(array5[index], array2[index]) && !compare(array2[index], array5[index]));
+        }
+
+        // sort the values as primitive keys, mixing in the largest values (which the networks pad each group with),
+        // and for floating-point, -0.0 and 0.0 (which compare equal, so they have to stay in their original order)
+        vector<int32_t> keys32;
+        vector<int64_t> keys64;
+        vector<float> floats;
+        vector<double> doubles;
+        for (size_t index = 0; index < total; index++) {
+            const size_t value = unsorted[index].value;
+            keys32.push_back(value % 7 == 0 ? numeric_limits<int32_t>::max() : (int32_t)(value % 1000000) - 500000);
+            keys64.push_back(value % 7 == 0 ? numeric_limits<int64_t>::max() : (int64_t)value * 4096 - 1000000);
+            floats.push_back(value % 7 == 0 ? numeric_limits<float>::infinity() :
+                             value % 5 == 0 ? -0.0f : value % 5 == 1 ? 0.0f : (value % 1000) * 0.5f - 250);
+            doubles.push_back(value % 7 == 0 ? numeric_limits<double>::infinity() :
+                              value % 5 == 0 ? -0.0 : value % 5 == 1 ? 0.0 : value * 0.5 - 250);
+        }
+        VerifyPrimitive(keys32);
+        VerifyPrimitive(keys64);
+        VerifyPrimitive(floats);
+        VerifyPrimitive(doubles);
+        VerifyPrimitiveMerge(keys32);
+        VerifyPrimitiveMerge(keys64);
     }
     cout << "passed!" << endl;
 #endif
 
+    // benchmark WikiSort with each of its cache policies
+    const Wiki::CachePolicy policies[] = {
+        Wiki::CachePolicy(Wiki::CachePolicy::Fixed),
+        Wiki::CachePolicy(Wiki::CachePolicy::SquareRoot),
+        Wiki::CachePolicy(Wiki::CachePolicy::Half),
+        Wiki::CachePolicy::Bytes(64 * 1024)
+    };
+    const string policy_names[] = { "fixed cache", "sqrt(n) cache", "half-size cache", "64 KB cache" };
+    const size_t policy_count = sizeof(policies)/sizeof(policies[0]);
+
     double total_time = Seconds();
-    double total_time1 = 0, total_time2 = 0;
+    double total_time1[policy_count], total_time2 = 0;
+    for (size_t policy = 0; policy < policy_count; policy++) total_time1[policy] = 0;
+
+    #if PROFILE
+        size_t total_compares1[policy_count], total_assigns1[policy_count];
+        for (size_t policy = 0; policy < policy_count; policy++) total_compares1[policy] = total_assigns1[policy] = 0;
+    #endif
 
     for (total = 0; total <= max_size; total += 2048 * 16) {
-        array1.resize(total);
         array2.resize(total);
 
         for (size_t index = 0; index < total; index++) {
@@ -1150,23 +3856,9 @@ int main() {
                 item.index = index;
             #endif
 
-            array1[index] = array2[index] = item;
+            array2[index] = item;
         }
-
-        double time1 = Seconds();
-        #if PROFILE
-            comparisons = assignments = 0;
-        #endif
-        Wiki::Sort(array1.begin(), array1.end(), compare);
-        time1 = Seconds() - time1;
-        total_time1 += time1;
-
-        #if PROFILE
-            compares1 = comparisons;
-            total_compares1 += compares1;
-            assigns1 = assignments;
-            total_assigns1 += assigns1;
-        #endif
+        const vector<Test> unsorted (array2);
 
         double time2 = Seconds();
         #if PROFILE
@@ -1190,41 +3882,64 @@ int main() {
 
         cout << "[" << total << "]" << endl;
 
-        if (time1 >= time2) cout << "WikiSort: " << time1 << " seconds, stable_sort: " << time2 << " seconds (" << time2/time1 * 100.0 << "% as fast)" << endl;
-        else cout << "WikiSort: " << time1 << " seconds, stable_sort: " << time2 << " seconds (" << time2/time1 * 100.0 - 100.0 << "% faster)" << endl;
+        for (size_t policy = 0; policy < policy_count; policy++) {
+            array1 = unsorted;
 
-        #if PROFILE
-            if (compares1 <= compares2) cout << "WikiSort: " << compares1 << " compares, stable_sort: " << compares2 << " compares (" << compares1 * 100.0/compares2 << "% as many)" << endl;
-            else cout << "WikiSort: " << compares1 << " compares, stable_sort: " << compares2 << " compares (" << compares1 * 100.0/compares2 - 100.0 << "% more)" << endl;
+            double time1 = Seconds();
+            #if PROFILE
+                comparisons = assignments = 0;
+            #endif
+            Wiki::Sort(array1.begin(), array1.end(), compare, policies[policy]);
+            time1 = Seconds() - time1;
+            total_time1[policy] += time1;
+
+            #if PROFILE
+                compares1 = comparisons;
+                total_compares1[policy] += compares1;
+                assigns1 = assignments;
+                total_assigns1[policy] += assigns1;
+            #endif
 
-            if (assigns1 <= assigns2) cout << "WikiSort: " << assigns1 << " assigns, stable_sort: " << assigns2 << " assigns (" << assigns1 * 100.0/assigns2 << "% as many)" << endl;
-            else cout << "WikiSort: " << assigns1 << " assigns, stable_sort: " << assigns2 << " assigns (" << assigns1 * 100.0/assigns2 - 100.0 << "% more)" << endl;
-        #endif
+            const string name = "WikiSort (" + policy_names[policy] + "): ";
+            if (time1 >= time2) cout << name << time1 << " seconds, stable_sort: " << time2 << " seconds (" << time2/time1 * 100.0 << "% as fast)" << endl;
+            else cout << name << time1 << " seconds, stable_sort: " << time2 << " seconds (" << time2/time1 * 100.0 - 100.0 << "% faster)" << endl;
 
-        #if VERIFY
-            // make sure the arrays are sorted correctly, and that the results were stable
-            cout << "verifying... " << flush;
+            #if PROFILE
+                if (compares1 <= compares2) cout << name << compares1 << " compares, stable_sort: " << compares2 << " compares (" << compares1 * 100.0/compares2 << "% as many)" << endl;
+                else cout << name << compares1 << " compares, stable_sort: " << compares2 << " compares (" << compares1 * 100.0/compares2 - 100.0 << "% more)" << endl;
 
-            Verify(array1.begin(), array1.end(), compare, "testing the final array");
-            for (size_t index = 0; index < total; index++)
-                assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+                if (assigns1 <= assigns2) cout << name << assigns1 << " assigns, stable_sort: " << assigns2 << " assigns (" << assigns1 * 100.0/assigns2 << "% as many)" << endl;
+                else cout << name << assigns1 << " assigns, stable_sort: " << assigns2 << " assigns (" << assigns1 * 100.0/assigns2 - 100.0 << "% more)" << endl;
+            #endif
 
-            cout << "correct!" << endl;
-        #endif
+            #if VERIFY
+                // make sure the arrays are sorted correctly, and that the results were stable
+                cout << "verifying... " << flush;
+
+                Verify(array1.begin(), array1.end(), compare, "testing the final array");
+                for (size_t index = 0; index < total; index++)
+                    assert(!compare(array1[index], array2[index]) && !compare(array2[index], array1[index]));
+
+                cout << "correct!" << endl;
+            #endif
+        }
     }
 
     total_time = Seconds() - total_time;
     cout << "Tests completed in " << total_time << " seconds" << endl;
-    if (total_time1 >= total_time2) cout << "WikiSort: " << total_time1 << " seconds, stable_sort: " << total_time2 << " seconds (" << total_time2/total_time1 * 100.0 << "% as fast)" << endl;
-    else cout << "WikiSort: " << total_time1 << " seconds, stable_sort: " << total_time2 << " seconds (" << total_time2/total_time1 * 100.0 - 100.0 << "% faster)" << endl;
+    for (size_t policy = 0; policy < policy_count; policy++) {
+        const string name = "WikiSort (" + policy_names[policy] + "): ";
+        if (total_time1[policy] >= total_time2) cout << name << total_time1[policy] << " seconds, stable_sort: " << total_time2 << " seconds (" << total_time2/total_time1[policy] * 100.0 << "% as fast)" << endl;
+        else cout << name << total_time1[policy] << " seconds, stable_sort: " << total_time2 << " seconds (" << total_time2/total_time1[policy] * 100.0 - 100.0 << "% faster)" << endl;
 
-    #if PROFILE
-        if (total_compares1 <= total_compares2) cout << "WikiSort: " << total_compares1 << " compares, stable_sort: " << total_compares2 << " compares (" << total_compares1 * 100.0/total_compares2 << "% as many)" << endl;
-        else cout << "WikiSort: " << total_compares1 << " compares, stable_sort: " << total_compares2 << " compares (" << total_compares1 * 100.0/total_compares2 - 100.0 << "% more)" << endl;
+        #if PROFILE
+            if (total_compares1[policy] <= total_compares2) cout << name << total_compares1[policy] << " compares, stable_sort: " << total_compares2 << " compares (" << total_compares1[policy] * 100.0/total_compares2 << "% as many)" << endl;
+            else cout << name << total_compares1[policy] << " compares, stable_sort: " << total_compares2 << " compares (" << total_compares1[policy] * 100.0/total_compares2 - 100.0 << "% more)" << endl;
 
-        if (total_assigns1 <= total_assigns2) cout << "WikiSort: " << total_assigns1 << " assigns, stable_sort: " << total_assigns2 << " assigns (" << total_assigns1 * 100.0/total_assigns2 << "% as many)" << endl;
-        else cout << "WikiSort: " << total_assigns1 << " assigns, stable_sort: " << total_assigns2 << " assigns (" << total_assigns1 * 100.0/total_assigns2 - 100.0 << "% more)" << endl;
-    #endif
+            if (total_assigns1[policy] <= total_assigns2) cout << name << total_assigns1[policy] << " assigns, stable_sort: " << total_assigns2 << " assigns (" << total_assigns1[policy] * 100.0/total_assigns2 << "% as many)" << endl;
+            else cout << name << total_assigns1[policy] << " assigns, stable_sort: " << total_assigns2 << " assigns (" << total_assigns1[policy] * 100.0/total_assigns2 - 100.0 << "% more)" << endl;
+        #endif
+    }
 
     return 0;
 }